@@ -4,19 +4,65 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <signal.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <time.h>
 #include <stdarg.h>
 #include <termios.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#ifdef PED_BENCH
+/* The benchmark counts the editor's own calls to the heap. */
+unsigned long bench_nmalloc;
+
+void *
+bench_malloc(size_t n)
+{
+    bench_nmalloc++;
+    return malloc(n);
+}
+
+void *
+bench_realloc(void * p, size_t n)
+{
+    bench_nmalloc++;
+    return realloc(p, n);
+}
+
+#define malloc(n) bench_malloc(n)
+#define realloc(p, n) bench_realloc(p, n)
+#endif
 
 /* Left off at: https://viewsourcecode.org/snaptoken/kilo/06.search.html */
 
 #define TAB_STOP 8
+#define GAP_THRESHOLD 4096  /* rows at least this long become gap buffers */
+#define GAP_MIN 1024        /* smallest gap left after growing one */
+#define SAVE_BATCH (1 << 20)    /* bytes copied before a save writes them out */
 #define QUIT_TIMES 2
+#define MSG_TIMEOUT 5       /* seconds a status message stays up */
+#define ESC_TIMEOUT 100     /* ms to wait for the rest of an escape sequence */
+#define PROGRESS_TICK 100   /* ms between progress updates of a running save */
+#define UNDO_MEM (8 << 20)  /* default cap on the memory undo history uses */
+#define RENDER_MEM (64 << 20)   /* default cap on render blocks, all buffers together */
+#define UNDO_MERGE_MAX 256  /* bytes of typing merged into one undo record */
+#define FOLLOW_CHUNK (1 << 20)  /* bytes read at a time from a followed file */
+#define FOLLOW_BATCH (32 << 20) /* bytes appended before the screen is redrawn */
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -32,6 +78,10 @@
 #define SHOW_CUR            ESC "[?25h"
 #define INV_COLOR           ESC "[7m"
 #define NORMAL_COLOR        ESC "[m"
+#define PASTE_ON            ESC "[?2004h"
+#define PASTE_OFF           ESC "[?2004l"
+#define PASTE_END           ESC "[201~"
+#define RESET_SCROLL_REGION ESC "[r"
 
 #define CLR_SCR_LEN         sizeof(CLR_SCR)-1
 #define CLR_ROW_LEN         sizeof(CLR_ROW)-1
@@ -42,6 +92,10 @@
 #define SHOW_CUR_LEN        sizeof(SHOW_CUR)-1
 #define INV_COLOR_LEN       sizeof(INV_COLOR)-1
 #define NORMAL_COLOR_LEN    sizeof(NORMAL_COLOR)-1
+#define PASTE_ON_LEN        sizeof(PASTE_ON)-1
+#define PASTE_OFF_LEN       sizeof(PASTE_OFF)-1
+#define PASTE_END_LEN       sizeof(PASTE_END)-1
+#define RESET_SCROLL_REGION_LEN sizeof(RESET_SCROLL_REGION)-1
 
 enum editor_key {
     KEY_BACKSPACE = 127,
@@ -54,31 +108,491 @@ enum editor_key {
     KEY_PG_UP,
     KEY_PG_DN,
     KEY_DEL,
-    KEY_INSERT
+    KEY_INSERT,
+    KEY_PASTE,      /* a bracketed paste, the text is in E.paste */
+    KEY_REDRAW      /* no key, but the screen needs redrawing */
 /*    KEY_LEFT  = 'h', */
 /*    KEY_RIGHT = 'l', */
 /*    KEY_UP    = 'k', */
 /*    KEY_DOWN  = 'j' */
 };
 
+enum row_flags {
+    ROW_MAPPED = 1 << 0,        /* chars points into E.map and is not owned */
+    ROW_RENDER_DIRTY = 1 << 1,  /* render no longer matches chars */
+    ROW_GAP = 1 << 2,           /* chars is a gap buffer, see editor_row_move_gap */
+    ROW_COMPLEX = 1 << 3,       /* gap row has a tab or a non-ASCII byte */
+    ROW_FROZEN = 1 << 4,        /* chars is being read by a save, see editor_row_frozen */
+    ROW_HL = 1 << 5,            /* render is followed by rsize bytes of highlighting */
+    ROW_HL_VALID = 1 << 6,      /* ... which match render and hlin */
+    ROW_LEX_DIRTY = 1 << 7,     /* hlout no longer matches chars */
+    ROW_UTF8 = 1 << 8,          /* render has characters wider than a byte */
+    ROW_PLAIN = 1 << 9,         /* render is chars itself, see editor_row_rtext */
+    ROW_COLMAP = 1 << 10,       /* the render block ends with a column map */
+    ROW_INLINE = 1 << 11        /* chars is stored in the erow, see ROW_INLINE_MAX */
+};
+
+/* Rendered rows at least COLMAP_MIN bytes long that are not plain ASCII
+   keep a column map: one mark per COLMAP_STEP bytes of render, so that
+   mapping between chars, render and columns never walks far. */
+#define COLMAP_MIN 1024
+#define COLMAP_STEP 256
+
+struct colmark {
+    int cx;                 /* a character in chars */
+    int rx;                 /* the column it is drawn at */
+    int rb;                 /* and where it starts in render */
+};
+
+/* Highlight classes, one per byte of a row, see editor_lex. */
+enum editor_highlight {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER,
+    HL_ERROR,
+    HL_WARNING,
+    HL_INFO,
+    HL_DEBUG
+};
+
+#define HL_NUMBERS (1 << 0)
+#define HL_STRINGS (1 << 1)
+#define HL_KEYS    (1 << 2)     /* a string followed by ':' is a key */
+#define HL_VARS    (1 << 3)     /* $NAME and ${...} */
+
+struct editor_keyword {
+    const char * word;
+    int hl;
+};
+
+struct editor_syntax {
+    const char * name;
+    const char ** filematch;    /* ".ext" matches an extension, anything
+                                   else part of the file name */
+    const struct editor_keyword * keywords; /* ends with a NULL word */
+    const char * comment;       /* runs to the end of the row */
+    const char * mlstart;       /* a comment that can span rows, the only */
+    const char * mlend;         /* lexer state carried from row to row */
+    int flags;
+};
+
+/* Size classes of the row arena, see arena_alloc. */
+#define ARENA_CLASSES 17
+#define ARENA_BIG ARENA_CLASSES
+#define ARENA_SLAB_SIZE (1 << 20)
+#define ARENA_BIG_ROUND 4096
+
+struct arena_slab {
+    struct arena_slab * next;
+    size_t size;
+};
+
+struct arena {
+    struct arena_slab * slabs;
+    char * top;                     /* unused tail of the newest slab */
+    size_t left;
+    void * free[ARENA_CLASSES];     /* freed blocks of each class */
+    unsigned long nalloc;
+    unsigned long nfree;
+    unsigned long nsys;             /* calls the arena made to malloc */
+    unsigned long nslabs;
+    unsigned long nbig;             /* live blocks too big for a class */
+    size_t live;                    /* bytes handed out from slabs */
+};
+
+struct abseg {
+    const char * p;         /* referenced bytes, or NULL for bytes in b */
+    int off;                /* where the bytes start in b */
+    int len;
+};
+
+struct abuf {
+    char * b;
+    int len;
+    int cap;
+    struct abseg * seg;
+    struct iovec * iov;     /* scratch for ab_write, segcap long */
+    int nseg;
+    int segcap;
+};
+
+#define ABUF_INIT {NULL, 0, 0, NULL, NULL, 0, 0};
+
+/* What a screen line was last drawn with, see editor_emit_line. */
+struct frame_line {
+    unsigned long hash;
+    int valid;
+};
+
+/* Rows are kept small since a large file has millions of them. A row of
+   up to ROW_INLINE_MAX bytes keeps its text in the erow itself; any other
+   owned chars buffer starts with a struct rowbuf and the render block
+   with a struct renderhead, see editor_row_render. */
+#define ROW_INLINE_MAX 7
+
 typedef struct erow {
     int size;
-    int rsize;
-    char * chars;
-    char * render;
+    unsigned short flags;
+    unsigned char hlin;     /* lexer state the row was lexed starting in */
+    unsigned char hlout;    /* and the state it ended in */
+    union {
+        char * p;           /* see editor_row_buf */
+        char in[ROW_INLINE_MAX + 1];
+    } chars;
+    char * render;          /* NULL until drawn, and for plain rows while
+                               there is no highlighting to keep */
 } erow;
 
+struct rowbuf {
+    int cap;                /* bytes reserved for chars after the header */
+    int gap;                /* start of the gap in a ROW_GAP row */
+};
+
+struct renderhead {
+    int rsize;              /* length of the render string */
+    int bytes;              /* size the block was allocated for */
+};
+
+/* A save runs on its own thread and writes out a snapshot of the rows: a
+   list of the spans of text they held when the save began. Those spans are
+   left untouched until the save is over, see editor_row_frozen. */
+struct save_seg {
+    const char * p;         /* or NULL for a short row copied into in */
+    int len;
+    int eol;                /* a newline follows */
+    char in[ROW_INLINE_MAX + 1];
+};
+
+struct save_job {
+    int active;             /* a worker is running or waiting to be joined */
+    pthread_t thread;
+    char * path;
+    mode_t mode;            /* for a file that does not exist yet */
+    struct save_seg * seg;
+    long nseg;
+    int buf;                /* the buffer being saved */
+    int dirty;              /* E.dirty when the snapshot was taken */
+    struct { void * p; size_t n; } * garbage;  /* frees put off until the end */
+    int ngarbage;
+    int garbagecap;
+    pthread_mutex_t lock;   /* guards the fields below */
+    long total;
+    long written;
+    int done;
+    int err;
+    struct timespec start, end;
+};
+
+/* A regular expression compiled for the search prompt: an NFA for the
+   pattern and one for the pattern reversed (see the regex section), and a
+   literal every match has to start with, used to skip rows cheaply. */
+#define RE_BOL 256              /* symbols for the start and end of a row */
+#define RE_EOL 257
+#define RE_SYMS 258
+#define RE_SETLEN ((RE_SYMS + 7) / 8)
+#define RE_PREFIX_MAX 64
+
+enum re_kind { RE_SET, RE_SPLIT, RE_EPS, RE_MATCH };
+
+struct re_state {
+    int kind;
+    int out, out1;          /* next states, out1 only for RE_SPLIT */
+    unsigned char set[RE_SETLEN];   /* symbols an RE_SET steps on */
+};
+
+struct re_prog {
+    struct re_state * st;
+    int nst;
+    int cap;
+    int start;
+};
+
+struct regex {
+    struct re_prog fwd;
+    struct re_prog rev;
+    char prefix[RE_PREFIX_MAX];
+    int prefixlen;
+};
+
+/* A DFA built lazily from an NFA. Each state is a sorted set of NFA
+   states; its transitions are filled in the first time they are taken.
+   When the cache grows past DFA_MEM_MAX it is thrown away and rebuilt,
+   so memory stays bounded whatever the pattern. */
+#define DFA_MEM_MAX (2 << 20)
+
+struct dfa_state {
+    int * nfa;
+    int n;
+    int accept;
+    int chain;              /* next state in the same hash bucket */
+    int next[RE_SYMS];      /* -1 until computed */
+};
+
+struct dfa {
+    struct re_prog * prog;
+    int anchored;           /* else a new thread starts after every byte */
+    struct dfa_state * st;
+    int nst;
+    int cap;
+    int * bucket;
+    int nbucket;
+    size_t mem;
+    int * list;             /* scratch, one entry per NFA state */
+    int * stack;
+    int * mark;
+    int gen;
+    int start;              /* the state with no symbols read, or -1 */
+    unsigned long nflush;
+};
+
+/* What a thread needs to run a regex: the DFAs are not shared. */
+struct matcher {
+    struct regex * re;      /* NULL for a literal search */
+    struct dfa rev;         /* finds where matches start */
+    struct dfa fwd;         /* finds where they end */
+    unsigned char * starts; /* per row position, set where a match starts */
+    int startscap;
+};
+
+/* An incremental search. While the prompt is open the rows cannot change,
+   so a pool of threads counts the matches in every FIND_CHUNK rows of the
+   file in parallel. Those counts, in row order, are the match index: they
+   give "match N of M" and let next/previous skip runs of rows without a
+   match. Chunks are handed out starting from the top of the screen. */
+#define FIND_CHUNK 4096
+#define FIND_THREADS_MAX 8
+
+/* Where one row's chars are, for the search workers. */
+struct find_span {
+    const char * p;
+    int len;
+};
+
+struct find_state {
+    int active;             /* the search prompt is open */
+    int cx, cy;             /* where the search started */
+    int coloff, rowoff;
+    int y, x;               /* current match, y is -1 if there is none */
+    int rank;               /* matches in its chunk before it */
+    int nthreads;
+    pthread_t thread[FIND_THREADS_MAX];
+    pthread_mutex_t lock;   /* guards everything below */
+    pthread_cond_t work;    /* signalled when chunks are queued */
+    pthread_cond_t done;    /* broadcast when a chunk has been counted */
+    char * query;
+    int qlen;
+    struct find_span * span;    /* each row searched, see editor_find_snapshot */
+    int spancap;
+    int numrows;
+    int nchunks;
+    int * count;            /* matches per chunk, FIND_TODO or FIND_RUNNING */
+    int * order;            /* chunks in the order they are handed out */
+    int next;               /* next entry of order to hand out */
+    int running;
+    int ndone;
+    long total;             /* matches in the chunks counted so far */
+    int regex;              /* the query is a regular expression */
+    int bad;                /* ... and it does not compile */
+    struct regex * re;
+    struct matcher match[FIND_THREADS_MAX + 1];    /* one per worker, the
+                                                      last for this thread */
+    char prompt[64];
+};
+
+#define FIND_TODO -1
+#define FIND_RUNNING -2
+
+/* Undo history, a log of the primitive edits: text inserted into or
+   deleted from a row, and rows inserted or deleted. Records live in a ring
+   buffer of cap bytes and the oldest are dropped to make room. Positions
+   in the log only grow; the record at p is at buf[p % cap] and never
+   wraps past the end of buf. Records made by one keypress share a seq and
+   are undone together. */
+enum undo_type { UNDO_INS, UNDO_DEL, UNDO_INS_ROW, UNDO_DEL_ROW };
+
+struct undo_rec {
+    unsigned long prev;     /* position of the record before */
+    unsigned long next;     /* and after, once there is one */
+    int size;               /* header and text, rounded up */
+    int type;
+    int y, at;
+    int len;                /* bytes of text after the header */
+    int seq;
+    int cx, cy;             /* cursor before the keypress */
+    int acx, acy;           /* and after it */
+};
+
+struct undo_log {
+    char * buf;
+    unsigned long cap;
+    unsigned long first;    /* oldest record */
+    unsigned long top;      /* newest record that can be undone */
+    unsigned long end;      /* where the next record goes */
+    int nundo;
+    int nredo;
+    int seq;                /* of the keypress being handled */
+    int cx, cy;             /* cursor when it started */
+    int off;                /* edits are not being logged */
+};
+
+enum prof_stage {
+    PROF_WAIT,              /* blocked waiting for the next key */
+    PROF_KEY,               /* editor_process_keypress, less waits and redraws */
+    PROF_SCROLL,            /* editor_scroll */
+    PROF_DRAW,              /* building the frame */
+    PROF_WRITE,             /* writing it out */
+    PROF_STAGES
+};
+
+#define PROF_WINDOW 128     /* samples the status bar percentiles cover */
+#define PROF_BUCKETS 24     /* histogram buckets, by powers of two of us */
+
+struct prof_hist {
+    double recent[PROF_WINDOW];
+    unsigned long count;
+    double sum;
+    double max;
+    unsigned long bucket[PROF_BUCKETS];
+};
+
+struct profiler {
+    int on;
+    char * dump;            /* the histogram is written here on exit */
+    double waited;          /* us blocked since the last key */
+    double inner;           /* us spent waiting or redrawing, see prof_key */
+    struct prof_hist stage[PROF_STAGES];
+};
+
+/* Follow mode: rows are appended as the file grows, like tail -f. The file
+   is watched with inotify where there is one, and polled otherwise. */
+struct follow_state {
+    int active;
+    int fd;             /* inotify instance, or -1 */
+    int wd;             /* watch on the file, or -1 to poll it */
+    int file;           /* open on the file being followed */
+    off_t off;          /* bytes of the file already in the buffer */
+    int partial;        /* the last row is still waiting for its newline */
+    int ready;          /* the file may have grown since it was last read */
+    int moved;          /* the file may have been renamed or replaced */
+    int held;           /* a prompt is up, so appending waits */
+    char * buf;
+};
+
+/* Several files can be open at once, each in a buffer. The current buffer
+   lives in E itself, so that the rest of the editor only ever deals with
+   one; the others are parked in E.bufs and swapped in by
+   editor_buffer_select. */
+struct buffer {
+    struct rownode * rows;
+    int numrows;
+    struct rownode * rowcache;
+    int rowcache_start;
+    int dirty;
+    char * filename;
+    char * map;
+    size_t maplen;
+    struct arena arena;
+    struct undo_log undo;
+    struct follow_state follow;
+    struct editor_syntax * syntax;
+    int hlrows;
+    int cx, cy;             /* where it was last looked at */
+    int rowoff, coloff;
+};
+
+/* The screen is split into windows stacked one above the other, each with
+   a status bar of its own; the message bar is shared. The focused
+   window's view is kept in E, the others' here. */
+struct window {
+    int buf;                /* buffer shown */
+    int cx, cy;
+    int rx;
+    int rowoff, coloff;
+    int frame_rowoff;
+    int top;                /* first screen line */
+    int rows;               /* text lines, the status bar not counted */
+};
+
+/* Render blocks are derived data, so every buffer's come out of one arena
+   and share one cap. Leaves with rows on screen are moved to the front of
+   a list as each frame is drawn, and once the frame is written the blocks
+   of the least recently drawn are freed until the cap is met again, see
+   editor_render_trim. */
+struct render_cache {
+    struct arena arena;
+    size_t bytes;           /* held by render blocks, as the arena rounds them */
+    size_t cap;
+    struct rownode * newest;
+    struct rownode * oldest;
+    unsigned long frame;    /* number of the frame being drawn */
+    unsigned long ntrim;    /* leaves whose blocks were freed */
+};
+
 struct editor_config {
     int cx, cy;
     int rx;
     int rowoff;
     int coloff;
-    int screenrows;
+    int screentop;              /* first screen line of the focused window */
+    int screenrows;             /* and its text lines */
     int screencols;
+    int termrows;
     int numrows;
-    erow * row;
+    struct rownode * rows;
+    struct rownode * rowcache;  /* leaf of the last row looked up */
+    int rowcache_start;         /* number of its first row */
     int dirty;
     char * filename;
+    char * map;
+    size_t maplen;
+    struct arena arena;
+    struct buffer * bufs;       /* entry curbuf is stale, its buffer is E */
+    int nbufs;
+    int bufcap;
+    int curbuf;
+    struct window * wins;       /* top to bottom */
+    int nwins;
+    int wincap;
+    int curwin;
+    struct render_cache rcache;
+    struct frame_line * frame;  /* one per screen line, bars included */
+    int framelines;
+    int frame_rowoff;           /* E.rowoff the text lines were drawn at */
+    int frame_lasty;            /* line last written during this refresh */
+    struct abuf out;            /* the frame being built */
+    struct abuf line;           /* the screen line being built */
+    char inbuf[4096];           /* input read but not yet decoded */
+    int inpos;
+    int inlen;
+    int record;                 /* input is copied here, see PED_RECORD */
+    char * paste;               /* body of the last bracketed paste */
+    int pastelen;
+    int pastecap;
+    int sigpipe[2];             /* written to wake poll(), by signal handlers
+                                   and by the save thread */
+    struct pollfd * fds;        /* scratch for editor_wait */
+    int fdcap;
+    int resized;                /* SIGWINCH arrived since the last refresh */
+    char * volatile lostmap;    /* a mapping that lost its tail, see
+                                   editor_handle_sigbus */
+    int zerofd;                 /* /dev/zero, mapped over what was lost */
+    long pagesize;
+    struct save_job save;
+    struct find_state find;
+    struct undo_log undo;
+    struct follow_state follow;
+    struct profiler prof;
+    struct editor_syntax * syntax;  /* NULL when not highlighting */
+    int hlrows;                 /* rows whose hlout is known to be right */
+    unsigned char * hlbuf;      /* scratch for lexing a row, see editor_row_text */
+    char * hltext;
+    int hlcap;
+    struct colmark * marks;     /* scratch for editor_row_render */
+    int markcap;
     char statusmsg[80];
     time_t statusmsg_time;
     struct termios orig_termios;
@@ -99,6 +613,7 @@ die(const char * s)
 void
 disable_raw()
 {
+    write(STDOUT_FILENO, PASTE_OFF, PASTE_OFF_LEN);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -127,11 +642,14 @@ enable_raw()
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
+
+    /* have the terminal mark pastes so they can be inserted in one go */
+    write(STDOUT_FILENO, PASTE_ON, PASTE_ON_LEN);
 }
 
 #if 0
@@ -154,614 +672,6041 @@ echo_key()
 }
 #endif
 
-int
-editor_read_key()
-{
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        /* In Cygwin, when read() times out it returns -1 with an errno of
-           EAGAIN, instead of just returning 0 like it’s supposed to. */
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
-    }
+/*** profiler ***/
 
-    if (c == ESC_CHAR) {
-        char seq[3];
+/* Stages of the main loop are timed while E.prof.on is set; see the
+   profile command. Times are in microseconds. */
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
-            return ESC_CHAR;
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
-            return ESC_CHAR;
+const char * prof_names[PROF_STAGES] = { "wait", "key", "scroll", "draw", "write" };
 
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return ESC_CHAR;
-                if (seq[2] == '~') {
-                    switch(seq[1]) {
-                        case '1': return KEY_HOME;
-                        case '2': return KEY_INSERT;
-                        case '3': return KEY_DEL;
-                        case '4': return KEY_END;
-                        case '5': return KEY_PG_UP;
-                        case '6': return KEY_PG_DN;
-                        case '7': return KEY_HOME;
-                        case '8': return KEY_END;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A': return KEY_UP;
-                    case 'B': return KEY_DOWN;
-                    case 'C': return KEY_RIGHT;
-                    case 'D': return KEY_LEFT;
-                    case 'H': return KEY_HOME;
-                    case 'F': return KEY_END;
-                }
-            }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H': return KEY_HOME;
-                case 'F': return KEY_END;
-            }
-        }
-        return ESC_CHAR;
-    } else {
-        return c;
-    }
+double
+prof_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
 }
 
-int
-get_cursor_position(int * rows, int * cols)
+void
+prof_add(int stage, double us)
 {
-    char buf[32];
-    unsigned int i = 0;
+    struct prof_hist * h = &E.prof.stage[stage];
+    double v = us;
+    int b = 0;
 
-    if (write(STDOUT_FILENO, GET_CUR_POS, 4) != 4)
-        return -1;
-
-    while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1)
-            break;
-        if (buf[i] == 'R')
-            break;
-        i++;
+    h->recent[h->count % PROF_WINDOW] = us;
+    h->count++;
+    h->sum += us;
+    if (us > h->max)
+        h->max = us;
+    while (v >= 2 && b < PROF_BUCKETS - 1) {
+        v /= 2;
+        b++;
     }
-    buf[i] = '\0';
-
-    if (buf[0] != ESC_CHAR || buf[1] != '[')
-        return -1;
-
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
-        return -1;
+    h->bucket[b]++;
+}
 
-    return 0;
+/* The time to measure a stage from, or 0 when not profiling. */
+double
+prof_start()
+{
+    return E.prof.on ? prof_now() : 0;
 }
 
-int
-get_window_size(int * rows, int * cols)
+/* Record the time since since as stage and return the time now, so
+   stages that follow each other can be timed in a row. */
+double
+prof_lap(int stage, double since)
 {
-    struct winsize ws;
+    double now;
 
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        if (write(STDOUT_FILENO, CUR_BOT_RIGHT, CUR_BOT_RIGHT_LEN) != CUR_BOT_RIGHT_LEN)
-            return -1;
-        return get_cursor_position(rows, cols);
-    } else {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
+    if (!E.prof.on)
         return 0;
-    }
+    now = prof_now();
+    if (since > 0)
+        prof_add(stage, now - since);
+    return now;
 }
 
-struct abuf {
-    char * b;
-    int len;
-};
+int
+prof_cmp(const void * a, const void * b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
 
-#define ABUF_INIT {NULL, 0};
+    return (x > y) - (x < y);
+}
 
+/* p50 and p99 of the last PROF_WINDOW samples of a stage. */
 void
-ab_append(struct abuf * ab, const char * s, int len)
+prof_recent(struct prof_hist * h, double * p50, double * p99)
 {
-    char * new = realloc(ab->b, ab->len + len);
+    double v[PROF_WINDOW];
+    int n = h->count < PROF_WINDOW ? (int) h->count : PROF_WINDOW;
 
-    if (new == NULL)
+    *p50 = *p99 = 0;
+    if (n == 0)
         return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    memcpy(v, h->recent, sizeof(double) * n);
+    qsort(v, n, sizeof(double), prof_cmp);
+    *p50 = v[(n - 1) / 2];
+    *p99 = v[(n - 1) * 99 / 100];
 }
 
-void
-abFree(struct abuf * ab)
+/* Print a time in at most four characters. */
+int
+prof_fmt(char * buf, int size, double us)
 {
-    free(ab->b);
+    if (us < 1000)
+        return snprintf(buf, size, "%d", (int) us);
+    if (us < 1e6)
+        return snprintf(buf, size, us < 1e4 ? "%.1fm" : "%.0fm", us / 1e3);
+    return snprintf(buf, size, "%.1fs", us / 1e6);
 }
 
+/* The right side of the status bar while profiling, e.g.
+   "w 900/2.1s k 15/80 s 1/2 d 30/95 o 6/9". */
 int
-editor_row_cx_to_rx(erow * row, int cx)
+prof_status(char * buf, int size)
 {
-    int rx = 0;
-    int j;
-    for (j=0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-        rx++;
+    int len = 0, j;
+
+    for (j = 0; j < PROF_STAGES && len < size; j++) {
+        double p50, p99;
+
+        prof_recent(&E.prof.stage[j], &p50, &p99);
+        len += snprintf(&buf[len], size - len, j ? " %c " : "%c ",
+                j == PROF_WRITE ? 'o' : prof_names[j][0]);
+        if (len < size)
+            len += prof_fmt(&buf[len], size - len, p50);
+        if (len < size)
+            len += snprintf(&buf[len], size - len, "/");
+        if (len < size)
+            len += prof_fmt(&buf[len], size - len, p99);
     }
-    return rx;
+    return len < size ? len : size - 1;
 }
 
-void
-editor_update_row(erow * row)
+/* The lowest time in histogram bucket b. */
+double
+prof_bucket_min(int b)
 {
-    int tabs = 0;
-    int j, idx;
+    return b == 0 ? 0 : (double) (1L << b);
+}
 
-    for (j=0; j < row->size; j++)
-        if (row->chars[j] == '\t')
-            tabs++;
+/* Write every stage's totals and histogram to E.prof.dump. Runs at
+   exit. */
+void
+prof_dump()
+{
+    FILE * fp;
+    int j, b;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TAB_STOP-1) + 1);
+    if (E.prof.dump == NULL || (fp = fopen(E.prof.dump, "w")) == NULL)
+        return;
+    fprintf(fp, "%-8s %10s %10s %10s %10s\n", "stage", "count", "mean us",
+            "max us", "total ms");
+    for (j = 0; j < PROF_STAGES; j++) {
+        struct prof_hist * h = &E.prof.stage[j];
+        fprintf(fp, "%-8s %10lu %10.1f %10.1f %10.1f\n", prof_names[j],
+                h->count, h->count ? h->sum / h->count : 0.0, h->max,
+                h->sum / 1e3);
+    }
+    fprintf(fp, "\n%-20s", "us");
+    for (j = 0; j < PROF_STAGES; j++)
+        fprintf(fp, " %8s", prof_names[j]);
+    fputc('\n', fp);
+    for (b = 0; b < PROF_BUCKETS; b++) {
+        int any = 0;
 
-    idx = 0;
-    for (j=0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0)
-                row->render[idx++] = ' ';
-        } else {
-            row->render[idx++]= row->chars[j];
-        }
+        for (j = 0; j < PROF_STAGES; j++)
+            any |= E.prof.stage[j].bucket[b] != 0;
+        if (!any)
+            continue;
+        if (b == PROF_BUCKETS - 1)
+            fprintf(fp, "%9.0f and up      ", prof_bucket_min(b));
+        else
+            fprintf(fp, "%9.0f - %-8.0f", prof_bucket_min(b), prof_bucket_min(b + 1));
+        for (j = 0; j < PROF_STAGES; j++)
+            fprintf(fp, " %8lu", E.prof.stage[j].bucket[b]);
+        fputc('\n', fp);
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    fclose(fp);
 }
 
+/* Start profiling. With a file name the histogram is written there when
+   the editor exits. */
 void
-editor_insert_row(int at, char * s, size_t len)
+prof_enable(const char * dump)
 {
-    if (at < 0 || at > E.numrows)
-        return;
-
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    static int registered = 0;
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editor_update_row(&E.row[at]);
-
-    E.numrows++;
-    E.dirty++;
+    E.prof.on = 1;
+    E.prof.waited = 0;
+    if (dump == NULL)
+        return;
+    free(E.prof.dump);
+    E.prof.dump = strdup(dump);
+    if (!registered) {
+        atexit(prof_dump);
+        registered = 1;
+    }
 }
 
+/*** events ***/
+
 void
-editor_free_row(erow * row)
+editor_handle_winch(int sig)
 {
-    free(row->render);
-    free(row->chars);
+    int saved = errno;
+
+    (void) sig;
+    write(E.sigpipe[1], "w", 1);
+    errno = saved;
 }
 
+/* Reading a mapped file past its end raises SIGBUS, which happens when
+   another process truncates a file that is open here, as log rotation
+   with copytruncate does. Whichever thread was reading, drawing, a search
+   or a save, gets zeroed pages mapped over the lost part so that the read
+   completes, and the main loop then warns about it. Faults outside the
+   mappings are left to kill the editor as before. */
 void
-editor_del_row(int at)
+editor_handle_sigbus(int sig, siginfo_t * info, void * ctx)
 {
-    if (at < 0 || at >= E.numrows)
-        return;
-    editor_free_row(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    E.numrows--;
-    E.dirty++;
+    char * addr = info->si_addr;
+    char * map = NULL;
+    size_t len = 0;
+    int saved = errno;
+    int j;
+
+    (void) ctx;
+    /* the current file's mapping is in E, the others' in E.bufs */
+    for (j = 0; j < E.nbufs; j++) {
+        map = j == E.curbuf ? E.map : E.bufs[j].map;
+        len = j == E.curbuf ? E.maplen : E.bufs[j].maplen;
+        if (map && addr >= map && addr < map + len)
+            break;
+    }
+    if (j == E.nbufs || E.zerofd == -1)
+        goto fatal;
+    addr = map + (addr - map) / E.pagesize * E.pagesize;
+    if (mmap(addr, map + len - addr, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                E.zerofd, 0) == MAP_FAILED)
+        goto fatal;
+    E.lostmap = map;
+    write(E.sigpipe[1], "b", 1);
+    errno = saved;
+    return;
+
+fatal:
+    signal(sig, SIG_DFL);
 }
 
+/* Signal handlers only write a byte to E.sigpipe. That wakes editor_wait
+   without racing poll(), and the real work is left to the next refresh. */
 void
-editor_row_insert_char(erow * row, int at, int c)
+editor_init_signals()
 {
-    if (at < 0 || at > row->size)
-        at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editor_update_row(row);
-    E.dirty++;
+    struct sigaction sa;
+    int j;
+
+    if (pipe(E.sigpipe) == -1)
+        die("pipe");
+    for (j=0; j<2; j++) {
+        fcntl(E.sigpipe[j], F_SETFL, fcntl(E.sigpipe[j], F_GETFL) | O_NONBLOCK);
+        fcntl(E.sigpipe[j], F_SETFD, FD_CLOEXEC);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editor_handle_winch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1)
+        die("sigaction");
+
+    E.pagesize = sysconf(_SC_PAGESIZE);
+    E.zerofd = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+    sa.sa_handler = NULL;
+    sa.sa_sigaction = editor_handle_sigbus;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    if (sigaction(SIGBUS, &sa, NULL) == -1)
+        die("sigaction");
 }
 
-void
-editor_row_append_string(erow * row, char * s, size_t len)
+/* The follow state of buffer j, which is in E while j is current. */
+struct follow_state *
+editor_buffer_follow(int j)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
-    E.dirty++;
+    return j == E.curbuf ? &E.follow : &E.bufs[j].follow;
 }
 
-void
-editor_row_del_char(erow * row, int at)
+/* Milliseconds until the screen changes without a key being pressed, or -1
+   if it never will. */
+int
+editor_timeout()
 {
-    if (at < 0 || at >= row->size)
-        return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editor_update_row(row);
-    E.dirty++;
+    struct timespec now;
+    long ms;
+    int j;
+
+    int busy = E.save.active;
+
+    for (j = 0; j < E.nbufs; j++) {
+        struct follow_state * f = editor_buffer_follow(j);
+        if (!f->active)
+            continue;
+        if (f->ready && !E.follow.held)
+            return 0;
+        if (f->wd == -1 || f->moved)
+            busy = 1;
+    }
+    if (E.find.active) {
+        pthread_mutex_lock(&E.find.lock);
+        if (E.find.ndone < E.find.nchunks)
+            busy = 1;
+        pthread_mutex_unlock(&E.find.lock);
+    }
+    if (E.statusmsg[0] == '\0' || time(NULL) - E.statusmsg_time >= MSG_TIMEOUT)
+        return busy ? PROGRESS_TICK : -1;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ms = (E.statusmsg_time + MSG_TIMEOUT - now.tv_sec) * 1000L
+        - now.tv_nsec / 1000000 + 1;
+    if (busy && ms > PROGRESS_TICK)
+        ms = PROGRESS_TICK;
+    return ms > 0 ? ms : 0;
 }
 
+#ifdef __linux__
+/* Read what inotify has queued for a followed file. Every event means it
+   may have grown; the rest may mean it is no longer the file at that name. */
 void
-editor_insert_char(int c)
+editor_follow_events(struct follow_state * f)
 {
-    if (E.cy == E.numrows) {
+    union {
+        struct inotify_event ev;
+        char buf[4096];
+    } u;
+    struct inotify_event * ev;
+    int n, j;
+
+    while ((n = read(f->fd, u.buf, sizeof(u.buf))) > 0) {
+        for (j = 0; j < n; j += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) &u.buf[j];
+            if (ev->mask & (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF))
+                f->moved = 1;
+            if (ev->mask & IN_IGNORED) {
+                f->moved = 1;
+                f->wd = -1;
+            }
+        }
+        f->ready = 1;
+    }
+}
+#endif
+
+/* Sleep until there is input, a signal or timeout ms have passed (-1 waits
+   forever). Returns 1 if stdin is ready. Followed files are watched in
+   every buffer, not just the current one. */
+int
+editor_wait(int timeout)
+{
+    struct pollfd * fds;
+    struct follow_state * f;
+    int nfds = 2;
+    double t0;
+    int j;
+
+    if (E.fdcap < E.nbufs + 2) {
+        E.fdcap = E.nbufs + 2;
+        E.fds = realloc(E.fds, sizeof(struct pollfd) * E.fdcap);
+        if (E.fds == NULL)
+            die("realloc");
+    }
+    fds = E.fds;
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = E.sigpipe[0];
+    fds[1].events = POLLIN;
+    for (j = 0; j < E.nbufs; j++) {
+        f = editor_buffer_follow(j);
+        if (f->active && f->fd != -1) {
+            fds[nfds].fd = f->fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+    }
+
+    t0 = prof_start();
+    if (poll(fds, nfds, timeout) == -1) {
+        if (errno == EINTR)
+            return 0;
+        die("poll");
+    }
+    if (t0 > 0) {
+        double waited = prof_now() - t0;
+        E.prof.waited += waited;
+        E.prof.inner += waited;
+    }
+    if (fds[1].revents & POLLIN) {
+        char buf[64];
+        int n, j;
+        while ((n = read(E.sigpipe[0], buf, sizeof(buf))) > 0)
+            for (j=0; j<n; j++)
+                if (buf[j] == 'w')
+                    E.resized = 1;
+    }
+#ifdef __linux__
+    for (j = 0, nfds = 2; j < E.nbufs; j++) {
+        f = editor_buffer_follow(j);
+        if (f->active && f->fd != -1 && (fds[nfds++].revents & POLLIN))
+            editor_follow_events(f);
+    }
+#endif
+    return (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+}
+
+/*** input ***/
+
+/* Input is read a buffer at a time and handed out a byte at a time.
+   Returns 0 if nothing arrived within timeout ms. */
+int
+editor_fill_input(int timeout)
+{
+    int nread;
+
+    if (!editor_wait(timeout))
+        return 0;
+    nread = read(STDIN_FILENO, E.inbuf, sizeof(E.inbuf));
+    if (nread == -1) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+        die("read");
+    }
+    if (nread == 0)
+        exit(1); /* the terminal went away */
+    if (E.record != -1 && write(E.record, E.inbuf, nread) != nread) {
+        close(E.record);
+        E.record = -1;
+    }
+    E.inpos = 0;
+    E.inlen = nread;
+    return nread;
+}
+
+int
+editor_read_byte(char * c, int timeout)
+{
+    if (E.inpos == E.inlen && editor_fill_input(timeout) == 0)
+        return 0;
+    *c = E.inbuf[E.inpos++];
+    return 1;
+}
+
+/* Read the rest of the UTF-8 character whose first byte is c, so that it
+   goes in with one keypress. Bytes that do not continue it are left for
+   the next key. Returns its length, with the bytes in buf. */
+int
+editor_read_utf8(int c, char * buf)
+{
+    int len = (c & 0xF0) == 0xF0 ? 4 : (c & 0xE0) == 0xE0 ? 3 : 2;
+    int n = 1;
+
+    buf[0] = c;
+    while (n < len && (E.inpos < E.inlen || editor_fill_input(ESC_TIMEOUT)) &&
+            (E.inbuf[E.inpos] & 0xC0) == 0x80)
+        buf[n++] = E.inbuf[E.inpos++];
+    return n;
+}
+
+/* Collect everything up to the end of a bracketed paste into E.paste.
+   Whole input buffers are copied at once; whatever follows the end marker
+   is left in E.inbuf for the next key. */
+void
+editor_read_paste()
+{
+    int endlen = PASTE_END_LEN;
+
+    E.pastelen = 0;
+    while (1) {
+        int n = E.inlen - E.inpos;
+        int from = E.pastelen > endlen ? E.pastelen - endlen : 0;
+        char * end;
+
+        if (n == 0) {
+            editor_fill_input(-1);
+            continue;
+        }
+        if (E.pastelen + n > E.pastecap) {
+            E.pastecap = E.pastecap ? E.pastecap * 2 : 4096;
+            if (E.pastecap < E.pastelen + n)
+                E.pastecap = E.pastelen + n;
+            E.paste = realloc(E.paste, E.pastecap);
+            if (E.paste == NULL)
+                die("realloc");
+        }
+        memcpy(&E.paste[E.pastelen], &E.inbuf[E.inpos], n);
+        E.pastelen += n;
+        E.inpos = E.inlen;
+
+        while ((end = memchr(&E.paste[from], ESC_CHAR, E.pastelen - from))) {
+            int k = end - E.paste;
+            if (k + endlen > E.pastelen)
+                break;
+            if (memcmp(end, PASTE_END, endlen) == 0) {
+                E.inpos = E.inlen - (E.pastelen - k - endlen);
+                E.pastelen = k;
+                return;
+            }
+            from = k + 1;
+        }
+    }
+}
+
+int
+editor_read_key()
+{
+    char c;
+
+    if (!editor_read_byte(&c, editor_timeout()))
+        return KEY_REDRAW;
+
+    if (c == ESC_CHAR) {
+        char seq[3];
+
+        if (!editor_read_byte(&seq[0], ESC_TIMEOUT))
+            return ESC_CHAR;
+        if (!editor_read_byte(&seq[1], ESC_TIMEOUT))
+            return ESC_CHAR;
+
+        if (seq[0] == '[') {
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                int n = seq[1] - '0';
+                while (1) {
+                    if (!editor_read_byte(&seq[2], ESC_TIMEOUT))
+                        return ESC_CHAR;
+                    if (seq[2] < '0' || seq[2] > '9' || n > 1000)
+                        break;
+                    n = n * 10 + seq[2] - '0';
+                }
+                if (seq[2] == '~') {
+                    switch(n) {
+                        case 1: return KEY_HOME;
+                        case 2: return KEY_INSERT;
+                        case 3: return KEY_DEL;
+                        case 4: return KEY_END;
+                        case 5: return KEY_PG_UP;
+                        case 6: return KEY_PG_DN;
+                        case 7: return KEY_HOME;
+                        case 8: return KEY_END;
+                        case 200:
+                            editor_read_paste();
+                            return KEY_PASTE;
+                    }
+                }
+            } else {
+                switch (seq[1]) {
+                    case 'A': return KEY_UP;
+                    case 'B': return KEY_DOWN;
+                    case 'C': return KEY_RIGHT;
+                    case 'D': return KEY_LEFT;
+                    case 'H': return KEY_HOME;
+                    case 'F': return KEY_END;
+                }
+            }
+        } else if (seq[0] == 'O') {
+            switch (seq[1]) {
+                case 'H': return KEY_HOME;
+                case 'F': return KEY_END;
+            }
+        }
+        return ESC_CHAR;
+    } else {
+        return c;
+    }
+}
+
+int
+get_cursor_position(int * rows, int * cols)
+{
+    char buf[32];
+    unsigned int i = 0;
+
+    if (write(STDOUT_FILENO, GET_CUR_POS, 4) != 4)
+        return -1;
+
+    while (i < sizeof(buf) - 1) {
+        if (!editor_read_byte(&buf[i], ESC_TIMEOUT))
+            break;
+        if (buf[i] == 'R')
+            break;
+        i++;
+    }
+    buf[i] = '\0';
+
+    if (buf[0] != ESC_CHAR || buf[1] != '[')
+        return -1;
+
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+        return -1;
+
+    return 0;
+}
+
+int
+get_window_size(int * rows, int * cols)
+{
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        if (write(STDOUT_FILENO, CUR_BOT_RIGHT, CUR_BOT_RIGHT_LEN) != CUR_BOT_RIGHT_LEN)
+            return -1;
+        return get_cursor_position(rows, cols);
+    } else {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+/* An append buffer is a list of pieces to be written out in order. Small
+   pieces are copied into b; long ones, such as the visible part of a row,
+   are only referenced so that they go out by writev straight from where
+   they live. Nothing is freed between frames: ab_reset keeps the memory for
+   the next one. */
+
+#define AB_COPY_MAX 32      /* pieces up to this long are copied anyway */
+
+#ifdef IOV_MAX
+#define AB_IOV_MAX IOV_MAX
+#else
+#define AB_IOV_MAX 1024
+#endif
+
+void
+ab_push_seg(struct abuf * ab, const char * p, int off, int len)
+{
+    if (ab->nseg == ab->segcap) {
+        ab->segcap = ab->segcap ? ab->segcap * 2 : 64;
+        ab->seg = realloc(ab->seg, sizeof(struct abseg) * ab->segcap);
+        ab->iov = realloc(ab->iov, sizeof(struct iovec) * ab->segcap);
+        if (ab->seg == NULL || ab->iov == NULL)
+            die("realloc");
+    }
+    ab->seg[ab->nseg].p = p;
+    ab->seg[ab->nseg].off = off;
+    ab->seg[ab->nseg].len = len;
+    ab->nseg++;
+}
+
+void
+ab_append(struct abuf * ab, const char * s, int len)
+{
+    struct abseg * last;
+
+    if (len <= 0)
+        return;
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 256;
+        while (cap < ab->len + len)
+            cap *= 2;
+        ab->b = realloc(ab->b, cap);
+        if (ab->b == NULL)
+            die("realloc");
+        ab->cap = cap;
+    }
+    memcpy(&ab->b[ab->len], s, len);
+
+    last = ab->nseg ? &ab->seg[ab->nseg - 1] : NULL;
+    if (last && last->p == NULL && last->off + last->len == ab->len)
+        last->len += len;
+    else
+        ab_push_seg(ab, NULL, ab->len, len);
+    ab->len += len;
+}
+
+/* Append len bytes at s without copying them. They must stay put until the
+   buffer has been written. */
+void
+ab_append_ref(struct abuf * ab, const char * s, int len)
+{
+    if (len <= AB_COPY_MAX)
+        ab_append(ab, s, len);
+    else
+        ab_push_seg(ab, s, 0, len);
+}
+
+/* Append everything in src to ab, keeping references as references. */
+void
+ab_append_abuf(struct abuf * ab, struct abuf * src)
+{
+    int j;
+
+    for (j=0; j<src->nseg; j++) {
+        struct abseg * seg = &src->seg[j];
+        if (seg->p)
+            ab_append_ref(ab, seg->p, seg->len);
+        else
+            ab_append(ab, &src->b[seg->off], seg->len);
+    }
+}
+
+void
+ab_reset(struct abuf * ab)
+{
+    ab->len = 0;
+    ab->nseg = 0;
+}
+
+/* Write the whole buffer to fd with as few writev calls as possible. */
+int
+ab_write(struct abuf * ab, int fd)
+{
+    struct iovec * iov = ab->iov;
+    int n = ab->nseg;
+    int j;
+
+    for (j=0; j<n; j++) {
+        struct abseg * seg = &ab->seg[j];
+        iov[j].iov_base = (char *) (seg->p ? seg->p : &ab->b[seg->off]);
+        iov[j].iov_len = seg->len;
+    }
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n < AB_IOV_MAX ? n : AB_IOV_MAX);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (n > 0 && (size_t) w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+void
+abFree(struct abuf * ab)
+{
+    free(ab->b);
+    free(ab->seg);
+    free(ab->iov);
+}
+
+/*** row arena ***/
+
+/* Row chars and render buffers are carved out of large slabs instead of
+   being malloc'd one by one. Each request is rounded up to one of a handful
+   of size classes and freed blocks go onto a per-class free list, so edits
+   that stay within a class reuse memory without calling malloc at all and
+   closing a file hands every slab back in one go. Requests bigger than the
+   largest class go to malloc. */
+
+const size_t arena_sizes[ARENA_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+    3072, 4096
+};
+
+int
+arena_class(size_t n)
+{
+    int cls;
+
+    for (cls=0; cls < ARENA_CLASSES; cls++)
+        if (n <= arena_sizes[cls])
+            return cls;
+    return ARENA_BIG;
+}
+
+/* Bytes actually reserved for a request of n. */
+size_t
+arena_round(size_t n)
+{
+    int cls = arena_class(n);
+
+    if (cls == ARENA_BIG)
+        return (n + ARENA_BIG_ROUND - 1) / ARENA_BIG_ROUND * ARENA_BIG_ROUND;
+    return arena_sizes[cls];
+}
+
+void *
+arena_alloc(struct arena * a, size_t n)
+{
+    int cls = arena_class(n);
+    size_t size;
+    void * p;
+
+    a->nalloc++;
+    if (cls == ARENA_BIG) {
+        a->nsys++;
+        a->nbig++;
+        p = malloc(arena_round(n));
+        if (p == NULL)
+            die("malloc");
+        return p;
+    }
+
+    size = arena_sizes[cls];
+    a->live += size;
+    if (a->free[cls] != NULL) {
+        p = a->free[cls];
+        a->free[cls] = *(void **) p;
+        return p;
+    }
+    if (a->left < size) {
+        struct arena_slab * slab = malloc(ARENA_SLAB_SIZE);
+        if (slab == NULL)
+            die("malloc");
+        a->nsys++;
+        a->nslabs++;
+        slab->next = a->slabs;
+        slab->size = ARENA_SLAB_SIZE;
+        a->slabs = slab;
+        a->top = (char *) (slab + 1);
+        a->left = ARENA_SLAB_SIZE - sizeof(struct arena_slab);
+    }
+    p = a->top;
+    a->top += size;
+    a->left -= size;
+    return p;
+}
+
+/* Return p, which was allocated for a request of n bytes (or any size in
+   the same class). */
+void
+arena_free(struct arena * a, void * p, size_t n)
+{
+    int cls = arena_class(n);
+
+    if (p == NULL)
+        return;
+    a->nfree++;
+    if (cls == ARENA_BIG) {
+        a->nbig--;
+        free(p);
+        return;
+    }
+    a->live -= arena_sizes[cls];
+    *(void **) p = a->free[cls];
+    a->free[cls] = p;
+}
+
+/* Drop every slab at once. Blocks too big for a class are not tracked here
+   and must be freed by the caller. */
+void
+arena_release(struct arena * a)
+{
+    while (a->slabs) {
+        struct arena_slab * slab = a->slabs;
+        a->slabs = slab->next;
+        free(slab);
+    }
+    a->top = NULL;
+    a->left = 0;
+    memset(a->free, 0, sizeof(a->free));
+    a->nslabs = 0;
+    a->live = 0;
+}
+
+/*** utf-8 ***/
+
+/* Rows hold UTF-8. A column is a cell on the screen: a tab runs to the
+   next tab stop, East Asian wide characters take two columns, combining
+   marks none, and bytes that are not valid UTF-8 are drawn as '?'. */
+
+struct utf8_range {
+    int lo, hi;
+};
+
+/* Combining marks and other characters of no width. */
+const struct utf8_range utf8_zero[] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF },
+    { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A },
+    { 0x064B, 0x065F }, { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+    { 0x0900, 0x0902 }, { 0x093C, 0x093C }, { 0x0941, 0x0948 }, { 0x094D, 0x094D },
+    { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF },
+    { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E }, { 0x2060, 0x2064 },
+    { 0x20D0, 0x20FF }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF },
+    { 0xE0100, 0xE01EF }
+};
+
+/* Wide and fullwidth characters, and emoji. */
+const struct utf8_range utf8_wide[] = {
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC },
+    { 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 },
+    { 0x2648, 0x2653 }, { 0x26A1, 0x26A1 }, { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE },
+    { 0x26C4, 0x26C5 }, { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F5 },
+    { 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+    { 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 },
+    { 0x2795, 0x2797 }, { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C },
+    { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x303E }, { 0x3041, 0x33FF },
+    { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF }, { 0xA960, 0xA97F },
+    { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F },
+    { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x16FE4 }, { 0x17000, 0x18CFF },
+    { 0x1B000, 0x1B2FF }, { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E },
+    { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F251 }, { 0x1F300, 0x1F64F }, { 0x1F680, 0x1F6FF },
+    { 0x1F7E0, 0x1F7EB }, { 0x1F90C, 0x1F9FF }, { 0x1FA70, 0x1FAFF }, { 0x20000, 0x2FFFD },
+    { 0x30000, 0x3FFFD }
+};
+
+int
+utf8_in(const struct utf8_range * r, int n, int cp)
+{
+    int lo = 0, hi = n - 1;
+
+    if (cp < r[0].lo || cp > r[hi].hi)
+        return 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp > r[mid].hi)
+            lo = mid + 1;
+        else if (cp < r[mid].lo)
+            hi = mid - 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+/* Columns taken by a code point. A table rather than wcwidth(), which
+   would make the display depend on the locale. */
+int
+utf8_width(int cp)
+{
+    if (utf8_in(utf8_zero, sizeof(utf8_zero) / sizeof(utf8_zero[0]), cp))
+        return 0;
+    if (utf8_in(utf8_wide, sizeof(utf8_wide) / sizeof(utf8_wide[0]), cp))
+        return 2;
+    return 1;
+}
+
+/* Decode the character at s, which has len bytes left. Returns its length
+   and sets *cp, or returns 0 if s does not start a valid sequence in its
+   shortest form. */
+int
+utf8_decode(const char * s, int len, int * cp)
+{
+    const unsigned char * u = (const unsigned char *) s;
+    int n, j, min;
+
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    } else if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+        n = 2;
+        *cp = u[0] & 0x1F;
+        min = 0x80;
+    } else if ((u[0] & 0xF0) == 0xE0) {
+        n = 3;
+        *cp = u[0] & 0x0F;
+        min = 0x800;
+    } else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+        n = 4;
+        *cp = u[0] & 0x07;
+        min = 0x10000;
+    } else {
+        return 0;
+    }
+    if (len < n)
+        return 0;
+    for (j = 1; j < n; j++) {
+        if ((u[j] & 0xC0) != 0x80)
+            return 0;
+        *cp = (*cp << 6) | (u[j] & 0x3F);
+    }
+    if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF))
+        return 0;
+    return n;
+}
+
+/* Whether every one of the len bytes at s is one column: ASCII and not a
+   tab. Most rows are, and need no decoding at all. */
+int
+utf8_plain(const char * s, int len)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    {
+        __m128i tab = _mm_set1_epi8('\t');
+
+        for (; len - i >= 16; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) &s[i]);
+            if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab))))
+                return 0;
+        }
+    }
+#endif
+
+    for (; i < len; i++)
+        if ((unsigned char) s[i] >= 0x80 || s[i] == '\t')
+            return 0;
+    return 1;
+}
+
+/* The bytes of a rendered row (no tabs, only valid UTF-8) that show in
+   columns [col, col + cols). Sets *start to the first and returns one past
+   the last. A wide character cut by col leaves *pad columns to blank. */
+int
+utf8_span(const char * s, int len, int col, int cols, int * start, int * pad)
+{
+    int x = 0, j = 0;
+    int n, w, cp;
+
+    while (j < len && x < col) {
+        n = utf8_decode(&s[j], len - j, &cp);
+        x += n ? utf8_width(cp) : 1;
+        j += n ? n : 1;
+    }
+    /* marks combining with a character that is off screen */
+    while (j < len && (n = utf8_decode(&s[j], len - j, &cp)) && utf8_width(cp) == 0)
+        j += n;
+    *pad = x > col ? x - col : 0;
+    *start = j;
+    while (j < len) {
+        n = utf8_decode(&s[j], len - j, &cp);
+        w = n ? utf8_width(cp) : 1;
+        if (x + w > col + cols)
+            break;
+        x += w;
+        j += n ? n : 1;
+    }
+    return j;
+}
+
+/*** gap rows ***/
+
+/* Rows of GAP_THRESHOLD bytes or more are edited as gap buffers: the text
+   before the last edit sits in chars[0..gap) and the text after it in the
+   last size - gap bytes of the cap byte buffer. Typing at the cursor fills
+   the gap instead of moving the rest of the line, and moving the gap only
+   costs the distance the cursor travelled since the previous edit. A row
+   whose gap is at its end is laid out exactly like any other row. */
+
+/* Where the text of a row is: in the erow itself for a ROW_INLINE row,
+   otherwise in the file mapping or a buffer of its own. */
+char *
+editor_row_buf(erow * row)
+{
+    return row->flags & ROW_INLINE ? row->chars.in : row->chars.p;
+}
+
+/* The header of a row's own chars buffer, for a row that is neither
+   mapped nor inline. */
+struct rowbuf *
+editor_row_head(erow * row)
+{
+    return (struct rowbuf *) row->chars.p - 1;
+}
+
+/* Bytes reserved for chars. A mapped row has none to write to. */
+int
+editor_row_cap(erow * row)
+{
+    if (row->flags & ROW_INLINE)
+        return ROW_INLINE_MAX + 1;
+    if (row->flags & ROW_MAPPED)
+        return 0;
+    return editor_row_head(row)->cap;
+}
+
+/* A new chars buffer with room for at least n bytes, which follow the
+   header returned. */
+struct rowbuf *
+editor_rowbuf_alloc(size_t n)
+{
+    size_t size = arena_round(sizeof(struct rowbuf) + n);
+    struct rowbuf * b = arena_alloc(&E.arena, size);
+
+    b->cap = size - sizeof(struct rowbuf);
+    b->gap = 0;
+    return b;
+}
+
+/* A row is frozen while a save is reading its chars. Its bytes must not
+   move or be overwritten until then, so a frozen row is copied before any
+   change that would, and its old buffer is only freed when the save ends.
+   Text added into the gap or after the end of a row does not disturb what
+   the save sees, which keeps plain typing copy-free. Inline rows are
+   copied into the snapshot instead and never frozen. The flag means
+   nothing in the other buffers, which may still carry it from a save of
+   their own. */
+int
+editor_row_frozen(erow * row)
+{
+    return E.save.active && E.save.buf == E.curbuf && (row->flags & ROW_FROZEN);
+}
+
+void
+editor_row_free_chars(erow * row)
+{
+    struct save_job * job = &E.save;
+    struct rowbuf * b;
+
+    if (row->flags & (ROW_MAPPED | ROW_INLINE))
+        return;
+    b = editor_row_head(row);
+    if (!editor_row_frozen(row)) {
+        arena_free(&E.arena, b, sizeof(*b) + b->cap);
+        return;
+    }
+    if (job->ngarbage == job->garbagecap) {
+        job->garbagecap = job->garbagecap ? job->garbagecap * 2 : 64;
+        job->garbage = realloc(job->garbage, sizeof(*job->garbage) * job->garbagecap);
+        if (job->garbage == NULL)
+            die("realloc");
+    }
+    job->garbage[job->ngarbage].p = b;
+    job->garbage[job->ngarbage].n = sizeof(*b) + b->cap;
+    job->ngarbage++;
+}
+
+/* Give a frozen gap row a copy of chars with the same layout. */
+void
+editor_row_thaw(erow * row)
+{
+    struct rowbuf * b, * copy;
+
+    if (!editor_row_frozen(row))
+        return;
+    b = editor_row_head(row);
+    copy = editor_rowbuf_alloc(b->cap);
+    memcpy(copy, b, sizeof(*b) + b->cap);
+    editor_row_free_chars(row);
+    row->chars.p = (char *) (copy + 1);
+    row->flags &= ~ROW_FROZEN;
+}
+
+void
+editor_row_move_gap(erow * row, int at)
+{
+    struct rowbuf * b = editor_row_head(row);
+    int gaplen = b->cap - row->size;
+    char * chars;
+
+    if (at != b->gap) {
+        editor_row_thaw(row);
+        b = editor_row_head(row);
+    }
+    chars = row->chars.p;
+    if (at < b->gap)
+        memmove(&chars[at + gaplen], &chars[at], b->gap - at);
+    else if (at > b->gap)
+        memmove(&chars[b->gap], &chars[b->gap + gaplen], at - b->gap);
+    b->gap = at;
+}
+
+/* Return chars as one contiguous, NUL terminated string. */
+char *
+editor_row_chars(erow * row)
+{
+    if (row->flags & ROW_GAP) {
+        editor_row_move_gap(row, row->size);
+        row->chars.p[row->size] = '\0';
+    }
+    return editor_row_buf(row);
+}
+
+void
+editor_row_update_complex(erow * row)
+{
+    struct rowbuf * b = editor_row_head(row);
+    char * chars = row->chars.p;
+
+    if (!utf8_plain(chars, b->gap) ||
+            !utf8_plain(&chars[b->gap + b->cap - row->size], row->size - b->gap))
+        row->flags |= ROW_COMPLEX;
+    else
+        row->flags &= ~ROW_COMPLEX;
+}
+
+/* Make sure the gap can take n more bytes while leaving one spare for the
+   terminator that editor_row_chars writes. */
+void
+editor_row_grow_gap(erow * row, int n)
+{
+    struct rowbuf * b = editor_row_head(row);
+    int gaplen = b->cap - row->size;
+    int tail = row->size - b->gap;
+    struct rowbuf * nb;
+    char * chars;
+
+    if (gaplen > n)
+        return;
+    nb = editor_rowbuf_alloc(row->size + n + 1 + row->size / 4 + GAP_MIN);
+    chars = (char *) (nb + 1);
+    memcpy(chars, row->chars.p, b->gap);
+    memcpy(&chars[nb->cap - tail], &row->chars.p[b->gap + gaplen], tail);
+    nb->gap = b->gap;
+    editor_row_free_chars(row);
+    row->chars.p = chars;
+    row->flags &= ~ROW_FROZEN;
+}
+
+void
+editor_row_gap_insert(erow * row, int at, const char * s, int len)
+{
+    struct rowbuf * b;
+
+    editor_row_grow_gap(row, len);
+    editor_row_move_gap(row, at);
+    b = editor_row_head(row);
+    memcpy(&row->chars.p[b->gap], s, len);
+    b->gap += len;
+    row->size += len;
+    if (!utf8_plain(s, len))
+        row->flags |= ROW_COMPLEX;
+}
+
+void
+editor_row_gap_delete(erow * row, int at, int len)
+{
+    int complex;
+
+    /* the deleted bytes become gap and would be typed over */
+    editor_row_thaw(row);
+    editor_row_move_gap(row, at);
+    complex = !utf8_plain(&row->chars.p[at + editor_row_head(row)->cap - row->size], len);
+    row->size -= len;
+    if (complex)
+        editor_row_update_complex(row);
+}
+
+/* Append the len bytes of a ROW_GAP row starting at at to ab. */
+void
+ab_append_gap(struct abuf * ab, erow * row, int at, int len)
+{
+    struct rowbuf * b = editor_row_head(row);
+    int n;
+
+    if (at < b->gap) {
+        n = b->gap - at < len ? b->gap - at : len;
+        ab_append_ref(ab, &row->chars.p[at], n);
+        at += n;
+        len -= n;
+    }
+    if (len > 0)
+        ab_append_ref(ab, &row->chars.p[at + b->cap - row->size], len);
+}
+
+/*** rows ***/
+
+/* Called whenever chars changes. Nothing is rendered here: rows are only
+   rendered once they are about to be drawn, by editor_row_render. */
+void
+editor_update_row(erow * row)
+{
+    row->flags |= ROW_RENDER_DIRTY | ROW_LEX_DIRTY;
+}
+
+/* Columns taken by the character at s, which has len bytes left, when it
+   starts in column col. Sets *n to its length. */
+int
+editor_char_width(const char * s, int len, int col, int * n)
+{
+    int cp;
+
+    if (s[0] == '\t') {
+        *n = 1;
+        return TAB_STOP - col % TAB_STOP;
+    }
+    if ((*n = utf8_decode(s, len, &cp)) == 0) {
+        *n = 1;
+        return 1;
+    }
+    return utf8_width(cp);
+}
+
+/* Length of the render string, which the render block starts with. A
+   plain row drawn without highlighting has no block and renders as chars. */
+int
+editor_row_rsize(erow * row)
+{
+    return row->render ? ((struct renderhead *) row->render)->rsize : row->size;
+}
+
+/* The render string of a rendered row: chars itself for a ROW_PLAIN row,
+   which only keeps its highlighting in the render block. Not NUL
+   terminated in that case. */
+char *
+editor_row_rtext(erow * row)
+{
+    if (row->flags & ROW_PLAIN)
+        return editor_row_buf(row);
+    return row->render + sizeof(struct renderhead);
+}
+
+/* Where the column map of a long row starts in its render block, see
+   editor_row_render. */
+int
+editor_colmap_offset(int rsize, int flags)
+{
+    int n = sizeof(struct renderhead) + rsize + 1 + (flags & ROW_HL ? rsize : 0);
+    return (n + sizeof(int) - 1) / sizeof(int) * sizeof(int);
+}
+
+struct colmark *
+editor_row_colmap(erow * row)
+{
+    return (struct colmark *) &row->render[editor_colmap_offset(editor_row_rsize(row), row->flags)];
+}
+
+/* Size of the render block: the header, the string unless the row is
+   plain and, while highlighting, a highlight class for each of its bytes,
+   then for a long row its column map. The string is sized for every tab
+   at its widest, so the header records what was actually allocated. */
+int
+editor_render_bytes(erow * row)
+{
+    return ((struct renderhead *) row->render)->bytes;
+}
+
+/* Render blocks are allocated and freed only through these two, which
+   keep E.rcache.bytes up to date. */
+char *
+editor_render_alloc(int bytes)
+{
+    E.rcache.bytes += arena_round(bytes);
+    return arena_alloc(&E.rcache.arena, bytes);
+}
+
+void
+editor_render_free(erow * row)
+{
+    int bytes;
+
+    if (row->render == NULL)
+        return;
+    bytes = editor_render_bytes(row);
+    E.rcache.bytes -= arena_round(bytes);
+    arena_free(&E.rcache.arena, row->render, bytes);
+    row->render = NULL;
+}
+
+/* Drop the render block of a row that is no longer on screen. It is built
+   again from chars the next time it is drawn. */
+void
+editor_row_evict(erow * row)
+{
+    if (row->render == NULL)
+        return;
+    editor_render_free(row);
+    row->flags = (row->flags | ROW_RENDER_DIRTY) &
+        ~(ROW_HL | ROW_HL_VALID | ROW_UTF8 | ROW_PLAIN | ROW_COLMAP);
+}
+
+/* Bring render up to date with chars and return it. The old render block is
+   reused when the new one needs the same arena size class. A row that is
+   all plain ASCII renders as chars itself and only needs a block to keep
+   its highlighting in; otherwise tabs are expanded and bytes that are not
+   valid UTF-8 replaced, so render only has valid characters. Such a row of
+   COLMAP_MIN bytes or more also gets a column map: mark k is the first
+   character at or past byte k * COLMAP_STEP of render. */
+char *
+editor_row_render(erow * row)
+{
+    int tabs = 0;
+    int plain, colmap;
+    int j, idx, col, rsize, bytes, n, w, k;
+    char * chars, * render;
+
+    if (!(row->flags & ROW_RENDER_DIRTY) &&
+            (E.syntax == NULL || (row->flags & ROW_HL)))
+        return editor_row_rtext(row);
+    chars = editor_row_chars(row);
+
+    plain = utf8_plain(chars, row->size);
+    if (!plain)
+        for (j=0; j < row->size; j++)
+            if (chars[j] == '\t')
+                tabs++;
+    colmap = !plain && row->size >= COLMAP_MIN;
+
+    rsize = row->size + tabs*(TAB_STOP-1);
+    bytes = sizeof(struct renderhead) + (plain ? 0 : rsize + 1) + (E.syntax ? rsize : 0);
+    if (colmap)
+        bytes = editor_colmap_offset(rsize, E.syntax ? ROW_HL : 0) +
+            (rsize / COLMAP_STEP + 1) * sizeof(struct colmark);
+    if (plain && E.syntax == NULL)
+        bytes = 0;
+    if (row->render != NULL &&
+            (bytes == 0 || arena_round(bytes) != arena_round(editor_render_bytes(row))))
+        editor_render_free(row);
+    if (row->render == NULL && bytes > 0)
+        row->render = editor_render_alloc(bytes);
+    if (row->render)
+        ((struct renderhead *) row->render)->bytes = bytes;
+    row->flags &= ~(ROW_RENDER_DIRTY | ROW_HL_VALID | ROW_UTF8 | ROW_HL |
+            ROW_PLAIN | ROW_COLMAP);
+    if (E.syntax)
+        row->flags |= ROW_HL;
+    if (colmap)
+        row->flags |= ROW_COLMAP;
+
+    if (plain) {
+        if (row->render)
+            ((struct renderhead *) row->render)->rsize = row->size;
+        row->flags |= ROW_PLAIN;
+        return chars;
+    }
+
+    if (colmap && E.markcap < rsize / COLMAP_STEP + 1) {
+        E.markcap = rsize / COLMAP_STEP + 1;
+        E.marks = realloc(E.marks, E.markcap * sizeof(struct colmark));
+        if (E.marks == NULL)
+            die("realloc");
+    }
+    render = row->render + sizeof(struct renderhead);
+    idx = col = k = 0;
+    for (j = 0; j < row->size; j += n) {
+        if (colmap && idx >= k * COLMAP_STEP) {
+            E.marks[k].cx = j;
+            E.marks[k].rx = col;
+            E.marks[k].rb = idx;
+            k++;
+        }
+        w = editor_char_width(&chars[j], row->size - j, col, &n);
+        if (chars[j] == '\t') {
+            memset(&render[idx], ' ', w);
+            idx += w;
+        } else if (n > 1) {
+            memcpy(&render[idx], &chars[j], n);
+            idx += n;
+            row->flags |= ROW_UTF8;
+        } else {
+            render[idx++] = (unsigned char) chars[j] < 0x80 ? chars[j] : '?';
+        }
+        col += w;
+    }
+    render[idx] = '\0';
+    ((struct renderhead *) row->render)->rsize = idx;
+    if (colmap) {
+        for (; k <= idx / COLMAP_STEP; k++) {
+            E.marks[k].cx = row->size;
+            E.marks[k].rx = col;
+            E.marks[k].rb = idx;
+        }
+        memcpy(editor_row_colmap(row), E.marks, k * sizeof(struct colmark));
+    }
+    return render;
+}
+
+/* The last mark of a row's column map at or before cx, or with by set, at
+   or before column rx. */
+struct colmark *
+editor_colmap_find(erow * row, int x, int by_rx)
+{
+    struct colmark * m = editor_row_colmap(row);
+    int lo = 0, hi = editor_row_rsize(row) / COLMAP_STEP;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if ((by_rx ? m[mid].rx : m[mid].cx) <= x)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return &m[lo];
+}
+
+/* Long rows are mapped through their render, which the cursor row needs
+   soon anyway: a plain row maps to itself and the column map of any other
+   leaves at most COLMAP_STEP bytes to walk. */
+int
+editor_row_cx_to_rx(erow * row, int cx)
+{
+    int rx = 0;
+    int j = 0;
+    int n;
+    char * chars;
+
+    if ((row->flags & ROW_GAP) && !(row->flags & ROW_COMPLEX))
+        return cx;
+    if (row->size >= COLMAP_MIN)
+        editor_row_render(row);
+    if (!(row->flags & ROW_RENDER_DIRTY)) {
+        if (row->flags & ROW_PLAIN)
+            return cx;
+        if (row->flags & ROW_COLMAP) {
+            struct colmark * m = editor_colmap_find(row, cx, 0);
+            j = m->cx;
+            rx = m->rx;
+        }
+    }
+    chars = editor_row_chars(row);
+    if (j == 0 && utf8_plain(chars, cx))
+        return cx;
+    for (; j < cx; j += n)
+        rx += editor_char_width(&chars[j], row->size - j, rx, &n);
+    return rx;
+}
+
+/* The character at column rx of row, or the end of the row. */
+int
+editor_row_rx_to_cx(erow * row, int rx)
+{
+    int cx = 0;
+    int col = 0;
+    int n, w;
+    char * chars;
+
+    if ((row->flags & ROW_GAP) && !(row->flags & ROW_COMPLEX))
+        return rx < row->size ? rx : row->size;
+    if (row->size >= COLMAP_MIN)
+        editor_row_render(row);
+    if (!(row->flags & ROW_RENDER_DIRTY)) {
+        if (row->flags & ROW_PLAIN)
+            return rx < row->size ? rx : row->size;
+        if (row->flags & ROW_COLMAP) {
+            struct colmark * m = editor_colmap_find(row, rx, 1);
+            cx = m->cx;
+            col = m->rx;
+        }
+    }
+    chars = editor_row_chars(row);
+    while (cx < row->size) {
+        w = editor_char_width(&chars[cx], row->size - cx, col, &n);
+        if (col + w > rx)
+            break;
+        col += w;
+        cx += n;
+    }
+    return cx;
+}
+
+/*** row storage ***/
+
+/* Rows live in a counted B-tree: leaves hold runs of erows in document
+   order and every node records how many rows sit beneath it, so finding,
+   inserting or deleting row n is O(log n) however large the file is.
+   Leaves are linked so that walking consecutive rows is O(1) per row.
+   Nodes also record the bytes beneath them, counting a newline per row,
+   which maps file offsets to rows and back in O(log n) as well. Leaves
+   are also where the render cache keeps track of what was drawn when, see
+   struct render_cache. */
+
+#define ROWS_LEAF_MAX 64
+#define ROWS_NODE_MAX 32
+
+struct rownode {
+    int leaf;
+    int n;                  /* rows in a leaf, children in an inner node */
+    int count;              /* rows stored beneath this node */
+    long bytes;             /* and their size on disk */
+    struct rownode * prev;  /* neighbouring leaves, leaves only */
+    struct rownode * next;
+    struct rownode * newer; /* render cache list, leaves only */
+    struct rownode * older;
+    unsigned long drawn;    /* frame last drawn in, 0 if not on the list */
+    union {
+        erow rows[ROWS_LEAF_MAX];
+        struct rownode * child[ROWS_NODE_MAX];
+    } u;
+};
+
+struct rowiter {
+    struct rownode * leaf;
+    int i;
+};
+
+struct rownode *
+rows_new_node(int leaf)
+{
+    struct rownode * node = malloc(sizeof(struct rownode));
+
+    if (node == NULL)
+        die("malloc");
+    node->leaf = leaf;
+    node->n = 0;
+    node->count = 0;
+    node->bytes = 0;
+    node->prev = NULL;
+    node->next = NULL;
+    node->newer = NULL;
+    node->older = NULL;
+    node->drawn = 0;
+    return node;
+}
+
+/* Take leaf off the render cache list. */
+void
+rows_lru_unlink(struct rownode * leaf)
+{
+    struct render_cache * c = &E.rcache;
+
+    if (leaf->drawn == 0)
+        return;
+    if (leaf->newer)
+        leaf->newer->older = leaf->older;
+    else
+        c->newest = leaf->older;
+    if (leaf->older)
+        leaf->older->newer = leaf->newer;
+    else
+        c->oldest = leaf->newer;
+    leaf->newer = leaf->older = NULL;
+    leaf->drawn = 0;
+}
+
+/* Move leaf to the front of the list: rows of it are being drawn. */
+void
+rows_lru_touch(struct rownode * leaf)
+{
+    struct render_cache * c = &E.rcache;
+
+    if (leaf->drawn == c->frame)
+        return;
+    rows_lru_unlink(leaf);
+    leaf->older = c->newest;
+    if (c->newest)
+        c->newest->newer = leaf;
+    else
+        c->oldest = leaf;
+    c->newest = leaf;
+    leaf->drawn = c->frame;
+}
+
+/* Rows with render blocks moved from one leaf to another: list the leaf
+   they went to where the one they came from is, unless it is listed
+   already. */
+void
+rows_lru_adopt(struct rownode * from, struct rownode * leaf)
+{
+    struct render_cache * c = &E.rcache;
+
+    if (from->drawn == 0 || leaf->drawn != 0)
+        return;
+    leaf->newer = from;
+    leaf->older = from->older;
+    if (from->older)
+        from->older->newer = leaf;
+    else
+        c->oldest = leaf;
+    from->older = leaf;
+    leaf->drawn = from->drawn;
+}
+
+int
+rows_full(struct rownode * node)
+{
+    return node->n == (node->leaf ? ROWS_LEAF_MAX : ROWS_NODE_MAX);
+}
+
+/* Split the full child i of node in two. When the split is caused by an
+   append to the end of the child, leave the child full so that loading a
+   file packs leaves densely instead of leaving them half empty. */
+void
+rows_split_child(struct rownode * node, int i, int appending)
+{
+    struct rownode * c = node->u.child[i];
+    struct rownode * s = rows_new_node(c->leaf);
+    int keep = appending ? c->n - 1 : c->n / 2;
+    int j;
+
+    s->n = c->n - keep;
+    if (c->leaf) {
+        memcpy(s->u.rows, &c->u.rows[keep], sizeof(erow) * s->n);
+        s->count = s->n;
+        for (j=0; j<s->n; j++)
+            s->bytes += s->u.rows[j].size + 1;
+        s->prev = c;
+        s->next = c->next;
+        if (c->next)
+            c->next->prev = s;
+        c->next = s;
+        rows_lru_adopt(c, s);
+    } else {
+        memcpy(s->u.child, &c->u.child[keep], sizeof(struct rownode *) * s->n);
+        for (j=0; j<s->n; j++) {
+            s->count += s->u.child[j]->count;
+            s->bytes += s->u.child[j]->bytes;
+        }
+    }
+    c->n = keep;
+    c->count -= s->count;
+    c->bytes -= s->bytes;
+
+    memmove(&node->u.child[i + 2], &node->u.child[i + 1],
+            sizeof(struct rownode *) * (node->n - i - 1));
+    node->u.child[i + 1] = s;
+    node->n++;
+}
+
+/* Return the child of node holding row *at and make *at relative to it. An
+   index one past the end resolves to the last child. */
+int
+rows_find_child(struct rownode * node, int * at)
+{
+    int i;
+
+    for (i=0; i < node->n - 1; i++) {
+        if (*at < node->u.child[i]->count)
+            break;
+        *at -= node->u.child[i]->count;
+    }
+    return i;
+}
+
+erow *
+rows_at(int at)
+{
+    struct rownode * node = E.rows;
+
+    if (at < 0 || at >= E.numrows)
+        return NULL;
+    if (E.rowcache && at >= E.rowcache_start &&
+            at < E.rowcache_start + E.rowcache->n)
+        return &E.rowcache->u.rows[at - E.rowcache_start];
+
+    E.rowcache_start = at;
+    while (!node->leaf)
+        node = node->u.child[rows_find_child(node, &at)];
+    E.rowcache = node;
+    E.rowcache_start -= at;
+    return &node->u.rows[at];
+}
+
+/* Insert a copy of *row so that it becomes row number at. */
+void
+rows_insert(int at, erow * row)
+{
+    struct rownode * node;
+
+    E.rowcache = NULL;
+    if (E.rows == NULL)
+        E.rows = rows_new_node(1);
+    if (rows_full(E.rows)) {
+        node = rows_new_node(0);
+        node->u.child[0] = E.rows;
+        node->n = 1;
+        node->count = E.rows->count;
+        node->bytes = E.rows->bytes;
+        E.rows = node;
+    }
+
+    node = E.rows;
+    while (!node->leaf) {
+        int i = rows_find_child(node, &at);
+        if (rows_full(node->u.child[i])) {
+            rows_split_child(node, i, at == node->u.child[i]->count);
+            if (at > node->u.child[i]->count) {
+                at -= node->u.child[i]->count;
+                i++;
+            }
+        }
+        node->count++;
+        node->bytes += row->size + 1;
+        node = node->u.child[i];
+    }
+
+    memmove(&node->u.rows[at + 1], &node->u.rows[at],
+            sizeof(erow) * (node->n - at));
+    node->u.rows[at] = *row;
+    node->n++;
+    node->count++;
+    node->bytes += row->size + 1;
+}
+
+/* Row at changed size by delta bytes. */
+void
+rows_resized(int at, int delta)
+{
+    struct rownode * node = E.rows;
+
+    while (1) {
+        node->bytes += delta;
+        if (node->leaf)
+            break;
+        node = node->u.child[rows_find_child(node, &at)];
+    }
+}
+
+/* Offset in the file of the first byte of row at. */
+long
+rows_offset(int at)
+{
+    struct rownode * node = E.rows;
+    long off = 0;
+    int i;
+
+    if (at >= E.numrows)
+        return node ? node->bytes : 0;
+    while (!node->leaf) {
+        for (i=0; i < node->n - 1 && at >= node->u.child[i]->count; i++) {
+            at -= node->u.child[i]->count;
+            off += node->u.child[i]->bytes;
+        }
+        node = node->u.child[i];
+    }
+    for (i=0; i < at; i++)
+        off += node->u.rows[i].size + 1;
+    return off;
+}
+
+/* The row holding the byte at offset off, or E.numrows past the end. */
+int
+rows_at_offset(long off)
+{
+    struct rownode * node = E.rows;
+    int at = 0;
+    int i;
+
+    if (node == NULL || off < 0 || off >= node->bytes)
+        return off < 0 ? 0 : E.numrows;
+    while (!node->leaf) {
+        for (i=0; i < node->n - 1 && off >= node->u.child[i]->bytes; i++) {
+            off -= node->u.child[i]->bytes;
+            at += node->u.child[i]->count;
+        }
+        node = node->u.child[i];
+    }
+    for (i=0; i < node->n - 1 && off >= node->u.rows[i].size + 1; i++)
+        off -= node->u.rows[i].size + 1;
+    return at + i;
+}
+
+void
+rows_unlink_leaf(struct rownode * leaf)
+{
+    if (leaf->prev)
+        leaf->prev->next = leaf->next;
+    if (leaf->next)
+        leaf->next->prev = leaf->prev;
+    rows_lru_unlink(leaf);
+}
+
+/* Fold child i + 1 of node into child i. */
+void
+rows_merge_children(struct rownode * node, int i)
+{
+    struct rownode * a = node->u.child[i];
+    struct rownode * b = node->u.child[i + 1];
+
+    if (a->leaf) {
+        memcpy(&a->u.rows[a->n], b->u.rows, sizeof(erow) * b->n);
+        rows_lru_adopt(b, a);
+        rows_unlink_leaf(b);
+    } else {
+        memcpy(&a->u.child[a->n], b->u.child, sizeof(struct rownode *) * b->n);
+    }
+    a->n += b->n;
+    a->count += b->count;
+    a->bytes += b->bytes;
+    free(b);
+
+    memmove(&node->u.child[i + 1], &node->u.child[i + 2],
+            sizeof(struct rownode *) * (node->n - i - 2));
+    node->n--;
+}
+
+/* After a delete below child i, drop it if it is empty or merge it with a
+   neighbour when the two fit in one node. */
+void
+rows_rebalance(struct rownode * node, int i)
+{
+    struct rownode * c = node->u.child[i];
+    int max = c->leaf ? ROWS_LEAF_MAX : ROWS_NODE_MAX;
+
+    if (c->n == 0) {
+        if (c->leaf)
+            rows_unlink_leaf(c);
+        free(c);
+        memmove(&node->u.child[i], &node->u.child[i + 1],
+                sizeof(struct rownode *) * (node->n - i - 1));
+        node->n--;
+    } else if (c->n < max / 2) {
+        if (i + 1 < node->n && c->n + node->u.child[i + 1]->n <= max)
+            rows_merge_children(node, i);
+        else if (i > 0 && c->n + node->u.child[i - 1]->n <= max)
+            rows_merge_children(node, i - 1);
+    }
+}
+
+void
+rows_delete_from(struct rownode * node, int at, erow * out)
+{
+    int i;
+
+    node->count--;
+    if (node->leaf) {
+        *out = node->u.rows[at];
+        memmove(&node->u.rows[at], &node->u.rows[at + 1],
+                sizeof(erow) * (node->n - at - 1));
+        node->n--;
+        node->bytes -= out->size + 1;
+        return;
+    }
+    i = rows_find_child(node, &at);
+    rows_delete_from(node->u.child[i], at, out);
+    node->bytes -= out->size + 1;
+    rows_rebalance(node, i);
+}
+
+/* Remove row number at, handing it back in *out. */
+void
+rows_delete(int at, erow * out)
+{
+    E.rowcache = NULL;
+    rows_delete_from(E.rows, at, out);
+    while (!E.rows->leaf && E.rows->n == 1) {
+        struct rownode * root = E.rows;
+        E.rows = root->u.child[0];
+        free(root);
+    }
+}
+
+/* Position it on row at and return it, for walking forward with
+   rows_iter_next. */
+erow *
+rows_iter_begin(struct rowiter * it, int at)
+{
+    erow * row = rows_at(at);
+
+    if (row == NULL) {
+        it->leaf = NULL;
+        it->i = 0;
+        return NULL;
+    }
+    it->leaf = E.rowcache;
+    it->i = at - E.rowcache_start;
+    return row;
+}
+
+erow *
+rows_iter_prev(struct rowiter * it)
+{
+    if (it->leaf == NULL)
+        return NULL;
+    if (it->i-- == 0) {
+        it->leaf = it->leaf->prev;
+        if (it->leaf == NULL)
+            return NULL;
+        it->i = it->leaf->n - 1;
+    }
+    return &it->leaf->u.rows[it->i];
+}
+
+erow *
+rows_iter_next(struct rowiter * it)
+{
+    if (it->leaf == NULL)
+        return NULL;
+    if (++it->i == it->leaf->n) {
+        it->leaf = it->leaf->next;
+        it->i = 0;
+        if (it->leaf == NULL)
+            return NULL;
+    }
+    return &it->leaf->u.rows[it->i];
+}
+
+void
+rows_free(struct rownode * node)
+{
+    int i;
+
+    if (node == NULL)
+        return;
+    if (!node->leaf)
+        for (i=0; i<node->n; i++)
+            rows_free(node->u.child[i]);
+    else
+        rows_lru_unlink(node);
+    free(node);
+}
+
+/* Bytes taken by the nodes of the tree, erows included. */
+size_t
+rows_mem(struct rownode * node)
+{
+    size_t n = sizeof(struct rownode);
+    int i;
+
+    if (node == NULL)
+        return 0;
+    if (!node->leaf)
+        for (i=0; i<node->n; i++)
+            n += rows_mem(node->u.child[i]);
+    return n;
+}
+
+/*** undo log ***/
+
+struct undo_rec *
+undo_at(unsigned long pos)
+{
+    return (struct undo_rec *) &E.undo.buf[pos % E.undo.cap];
+}
+
+/* Forget every record. */
+void
+undo_clear()
+{
+    struct undo_log * u = &E.undo;
+
+    u->first = u->top = u->end = 0;
+    u->nundo = u->nredo = 0;
+}
+
+/* Make room for a record of size bytes and return its position, dropping
+   the redo records and as many of the oldest as needed. Returns -1 if it
+   could never fit. */
+long
+undo_alloc(int size)
+{
+    struct undo_log * u = &E.undo;
+    unsigned long pos;
+
+    if (u->buf == NULL) {
+        if (u->cap == 0)
+            u->cap = UNDO_MEM;
+        if ((u->buf = malloc(u->cap)) == NULL)
+            die("malloc");
+    }
+    if ((unsigned long) size > u->cap) {
+        undo_clear();
+        return -1;
+    }
+    if (u->nredo > 0) {
+        u->end = u->nundo ? u->top + undo_at(u->top)->size : u->first;
+        u->nredo = 0;
+    }
+    pos = u->end;
+    if (pos % u->cap + size > u->cap)
+        pos += u->cap - pos % u->cap;
+    while (u->nundo > 0 && pos + size - u->first > u->cap) {
+        u->first = undo_at(u->first)->next;
+        u->nundo--;
+    }
+    if (u->nundo == 0)
+        u->first = pos;
+    return pos;
+}
+
+/* Merge an edit into the newest record if it carries on the same run of
+   typing or deleting, returning where its len bytes go, or NULL. */
+char *
+undo_merge(int type, int y, int at, int len)
+{
+    struct undo_log * u = &E.undo;
+    struct undo_rec * r;
+    unsigned long size;
+    char * text;
+
+    if (len != 1 || u->nundo == 0 || u->nredo > 0)
+        return NULL;
+    r = undo_at(u->top);
+    text = (char *) (r + 1);
+    size = (sizeof(struct undo_rec) + r->len + len + sizeof(long) - 1) &
+        ~(sizeof(long) - 1);
+    if (r->type != type || r->y != y || r->len + len > UNDO_MERGE_MAX ||
+            (u->nundo > 1 && undo_at(r->prev)->seq == r->seq) ||
+            u->top % u->cap + size > u->cap || u->top + size - u->first > u->cap)
+        return NULL;
+
+    if (type == UNDO_INS && at == r->at + r->len) {
+        text += r->len;
+    } else if (type == UNDO_DEL && at == r->at) {
+        text += r->len;
+    } else if (type == UNDO_DEL && at + len == r->at) {
+        memmove(text + len, text, r->len);
+        r->at = at;
+    } else {
+        return NULL;
+    }
+    r->len += len;
+    r->size = size;
+    r->seq = u->seq;
+    u->end = u->top + size;
+    return text;
+}
+
+/* Log an edit and return where its len bytes of text go, or NULL if it is
+   not being logged. */
+char *
+undo_add(int type, int y, int at, int len)
+{
+    struct undo_log * u = &E.undo;
+    struct undo_rec * r;
+    char * text;
+    int size;
+    long pos;
+
+    if (u->off)
+        return NULL;
+    if ((text = undo_merge(type, y, at, len)) != NULL)
+        return text;
+    size = (sizeof(struct undo_rec) + len + sizeof(long) - 1) & ~(sizeof(long) - 1);
+    if ((pos = undo_alloc(size)) == -1)
+        return NULL;
+    r = undo_at(pos);
+    r->prev = u->top;
+    r->size = size;
+    r->type = type;
+    r->y = y;
+    r->at = at;
+    r->len = len;
+    r->seq = u->seq;
+    r->cx = r->acx = u->cx;
+    r->cy = r->acy = u->cy;
+    if (u->nundo > 0)
+        undo_at(u->top)->next = pos;
+    u->top = pos;
+    u->end = pos + size;
+    u->nundo++;
+    return (char *) (r + 1);
+}
+
+/* Copy len bytes of row from column at, wherever the gap is. */
+void
+editor_row_copy(erow * row, int at, int len, char * dst)
+{
+    char * chars = editor_row_buf(row);
+    int gap = row->size, gaplen = 0;
+    int n = 0;
+
+    if (row->flags & ROW_GAP) {
+        gap = editor_row_head(row)->gap;
+        gaplen = editor_row_head(row)->cap - row->size;
+    }
+    if (at < gap) {
+        n = gap - at < len ? gap - at : len;
+        memcpy(dst, &chars[at], n);
+    }
+    if (n < len) {
+        at += n;
+        if (at >= gap)
+            at += gaplen;
+        memcpy(dst + n, &chars[at], len - n);
+    }
+}
+
+/*** syntax highlighting ***/
+
+/* Rows are lexed one at a time. The only state carried from one row to
+   the next is whether it ends inside a multi-line comment: each row keeps
+   the state it was lexed starting in and the state it ended in, and a row
+   whose chars have not changed and that starts in the same state as last
+   time needs no lexing to know where it ends. */
+
+const char * c_filematch[] = { ".c", ".h", ".cc", ".cpp", ".hpp", NULL };
+const struct editor_keyword c_keywords[] = {
+    { "if", HL_KEYWORD1 }, { "else", HL_KEYWORD1 }, { "for", HL_KEYWORD1 },
+    { "while", HL_KEYWORD1 }, { "do", HL_KEYWORD1 }, { "switch", HL_KEYWORD1 },
+    { "case", HL_KEYWORD1 }, { "default", HL_KEYWORD1 }, { "break", HL_KEYWORD1 },
+    { "continue", HL_KEYWORD1 }, { "return", HL_KEYWORD1 }, { "goto", HL_KEYWORD1 },
+    { "sizeof", HL_KEYWORD1 }, { "struct", HL_KEYWORD1 }, { "union", HL_KEYWORD1 },
+    { "enum", HL_KEYWORD1 }, { "typedef", HL_KEYWORD1 }, { "static", HL_KEYWORD1 },
+    { "const", HL_KEYWORD1 }, { "extern", HL_KEYWORD1 }, { "volatile", HL_KEYWORD1 },
+    { "register", HL_KEYWORD1 }, { "#include", HL_KEYWORD1 }, { "#define", HL_KEYWORD1 },
+    { "#if", HL_KEYWORD1 }, { "#ifdef", HL_KEYWORD1 }, { "#ifndef", HL_KEYWORD1 },
+    { "#else", HL_KEYWORD1 }, { "#elif", HL_KEYWORD1 }, { "#endif", HL_KEYWORD1 },
+    { "#undef", HL_KEYWORD1 },
+    { "int", HL_KEYWORD2 }, { "long", HL_KEYWORD2 }, { "short", HL_KEYWORD2 },
+    { "char", HL_KEYWORD2 }, { "unsigned", HL_KEYWORD2 }, { "signed", HL_KEYWORD2 },
+    { "float", HL_KEYWORD2 }, { "double", HL_KEYWORD2 }, { "void", HL_KEYWORD2 },
+    { "size_t", HL_KEYWORD2 }, { "ssize_t", HL_KEYWORD2 }, { "NULL", HL_KEYWORD2 },
+    { NULL, 0 }
+};
+
+const char * sh_filematch[] = { ".sh", ".bash", ".bashrc", ".profile", NULL };
+const struct editor_keyword sh_keywords[] = {
+    { "if", HL_KEYWORD1 }, { "then", HL_KEYWORD1 }, { "else", HL_KEYWORD1 },
+    { "elif", HL_KEYWORD1 }, { "fi", HL_KEYWORD1 }, { "for", HL_KEYWORD1 },
+    { "while", HL_KEYWORD1 }, { "until", HL_KEYWORD1 }, { "do", HL_KEYWORD1 },
+    { "done", HL_KEYWORD1 }, { "case", HL_KEYWORD1 }, { "esac", HL_KEYWORD1 },
+    { "in", HL_KEYWORD1 }, { "function", HL_KEYWORD1 }, { "return", HL_KEYWORD1 },
+    { "exit", HL_KEYWORD1 }, { "local", HL_KEYWORD1 }, { "export", HL_KEYWORD1 },
+    { "readonly", HL_KEYWORD1 },
+    { NULL, 0 }
+};
+
+const char * json_filematch[] = { ".json", NULL };
+const struct editor_keyword json_keywords[] = {
+    { "true", HL_KEYWORD1 }, { "false", HL_KEYWORD1 }, { "null", HL_KEYWORD1 },
+    { NULL, 0 }
+};
+
+const char * log_filematch[] = { ".log", NULL };
+const struct editor_keyword log_keywords[] = {
+    { "FATAL", HL_ERROR }, { "PANIC", HL_ERROR }, { "CRIT", HL_ERROR },
+    { "CRITICAL", HL_ERROR }, { "ERROR", HL_ERROR }, { "ERR", HL_ERROR },
+    { "fatal", HL_ERROR }, { "error", HL_ERROR },
+    { "WARN", HL_WARNING }, { "WARNING", HL_WARNING },
+    { "warn", HL_WARNING }, { "warning", HL_WARNING },
+    { "INFO", HL_INFO }, { "NOTICE", HL_INFO }, { "info", HL_INFO },
+    { "DEBUG", HL_DEBUG }, { "TRACE", HL_DEBUG }, { "debug", HL_DEBUG },
+    { NULL, 0 }
+};
+
+struct editor_syntax HLDB[] = {
+    { "c", c_filematch, c_keywords, "//", "/*", "*/", HL_NUMBERS | HL_STRINGS },
+    { "sh", sh_filematch, sh_keywords, "#", NULL, NULL,
+        HL_NUMBERS | HL_STRINGS | HL_VARS },
+    { "json", json_filematch, json_keywords, NULL, NULL, NULL,
+        HL_NUMBERS | HL_STRINGS | HL_KEYS },
+    { "log", log_filematch, log_keywords, NULL, NULL, NULL, HL_NUMBERS }
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+/* SGR sequence for each highlight class. Classes that look the same share
+   a string, so comparing pointers tells whether the colour changes. */
+const char HL_DEFAULT_COLOR[] = ESC "[39m";
+const char HL_COMMENT_COLOR[] = ESC "[36m";
+
+const char * hl_colors[] = {
+    HL_DEFAULT_COLOR,       /* HL_NORMAL */
+    HL_COMMENT_COLOR,       /* HL_COMMENT */
+    HL_COMMENT_COLOR,       /* HL_MLCOMMENT */
+    ESC "[33m",             /* HL_KEYWORD1 */
+    ESC "[32m",             /* HL_KEYWORD2 */
+    ESC "[35m",             /* HL_STRING */
+    ESC "[31m",             /* HL_NUMBER */
+    ESC "[91m",             /* HL_ERROR */
+    ESC "[93m",             /* HL_WARNING */
+    ESC "[32m",             /* HL_INFO */
+    ESC "[90m"              /* HL_DEBUG */
+};
+
+int
+editor_is_separator(int c)
+{
+    if (isalnum(c) || c == '_' || c >= 0x80)
+        return 0;
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:&|!?^\"'", c) != NULL;
+}
+
+/* Highlight the len bytes of s into hl, starting in lexer state state,
+   and return the state at the end. Tabs and spaces are treated alike, so
+   lexing chars and lexing render end in the same state. Whether a byte
+   starts a word only depends on the byte before it, which editor_lex_state
+   relies on. */
+int
+editor_lex(const struct editor_syntax * syn, const char * s, int len,
+        int state, unsigned char * hl)
+{
+    const struct editor_keyword * kw;
+    int sclen = syn->comment ? strlen(syn->comment) : 0;
+    int mslen = syn->mlstart ? strlen(syn->mlstart) : 0;
+    int melen = syn->mlend ? strlen(syn->mlend) : 0;
+    int sep = 1;            /* the byte before ends a word */
+    int i = 0;
+    int j, k;
+
+    memset(hl, HL_NORMAL, len);
+    while (i < len) {
+        int c = (unsigned char) s[i];
+        int prev = i > 0 ? hl[i-1] : HL_NORMAL;
+
+        if (state) {
+            if (c == syn->mlend[0] && len - i >= melen &&
+                    !memcmp(&s[i], syn->mlend, melen)) {
+                memset(&hl[i], HL_MLCOMMENT, melen);
+                i += melen;
+                state = 0;
+                sep = 1;
+            } else {
+                hl[i++] = HL_MLCOMMENT;
+            }
+            continue;
+        }
+        if (sclen && sep && c == syn->comment[0] && len - i >= sclen &&
+                !memcmp(&s[i], syn->comment, sclen)) {
+            memset(&hl[i], HL_COMMENT, len - i);
+            break;
+        }
+        if (mslen && c == syn->mlstart[0] && len - i >= mslen &&
+                !memcmp(&s[i], syn->mlstart, mslen)) {
+            memset(&hl[i], HL_MLCOMMENT, mslen);
+            i += mslen;
+            state = 1;
+            continue;
+        }
+        if ((syn->flags & HL_STRINGS) && (c == '"' || c == '\'')) {
+            int h = HL_STRING;
+            for (j = i + 1; j < len && s[j] != c; j++)
+                if (s[j] == '\\' && j + 1 < len)
+                    j++;
+            if (j < len)
+                j++;
+            if (syn->flags & HL_KEYS) {
+                k = j;
+                while (k < len && isspace((unsigned char) s[k]))
+                    k++;
+                if (k < len && s[k] == ':')
+                    h = HL_KEYWORD2;
+            }
+            memset(&hl[i], h, j - i);
+            i = j;
+            sep = 1;
+            continue;
+        }
+        if ((syn->flags & HL_VARS) && c == '$' && i + 1 < len) {
+            j = i + 1;
+            if (s[j] == '{') {
+                while (j < len && s[j] != '}')
+                    j++;
+                if (j < len)
+                    j++;
+            } else if (isalnum((unsigned char) s[j]) || s[j] == '_') {
+                while (j < len && (isalnum((unsigned char) s[j]) || s[j] == '_'))
+                    j++;
+            } else {
+                j++;        /* $?, $# and the like */
+            }
+            memset(&hl[i], HL_KEYWORD2, j - i);
+            i = j;
+            sep = 0;
+            continue;
+        }
+        if ((syn->flags & HL_NUMBERS) &&
+                ((isdigit(c) && (sep || prev == HL_NUMBER)) ||
+                 ((isalnum(c) || c == '.') && prev == HL_NUMBER))) {
+            hl[i++] = HL_NUMBER;
+            sep = editor_is_separator(c);
+            continue;
+        }
+        if (sep && syn->keywords) {
+            k = 0;
+            for (kw = syn->keywords; kw->word; kw++) {
+                if (kw->word[0] != c)
+                    continue;
+                k = strlen(kw->word);
+                if (len - i >= k && !memcmp(&s[i], kw->word, k) &&
+                        (i + k == len || editor_is_separator((unsigned char) s[i + k])))
+                    break;
+            }
+            if (kw->word) {
+                memset(&hl[i], kw->hl, k);
+                i += k;
+                sep = 0;
+                continue;
+            }
+        }
+        sep = editor_is_separator(c);
+        i++;
+    }
+    return state;
+}
+
+/* The state editor_lex would end in, found by only looking at the bytes
+   that can start or end a comment or a string. Keywords and numbers never
+   contain one, so they can be skipped over. Only needed for syntaxes with
+   multi-line comments. */
+int
+editor_lex_state(const struct editor_syntax * syn, const char * s, int len, int state)
+{
+    int sclen = syn->comment ? strlen(syn->comment) : 0;
+    int mslen = strlen(syn->mlstart);
+    int melen = strlen(syn->mlend);
+    int strings = syn->flags & HL_STRINGS;
+    int i = 0;
+    int c;
+
+    while (i < len) {
+        if (state) {
+            const char * p = &s[i];
+            while ((p = memchr(p, syn->mlend[0], &s[len] - p)) != NULL &&
+                    (&s[len] - p < melen || memcmp(p, syn->mlend, melen)))
+                p++;
+            if (p == NULL)
+                return state;
+            i = p - s + melen;
+            state = 0;
+            continue;
+        }
+        c = (unsigned char) s[i];
+        if (sclen && c == syn->comment[0] && len - i >= sclen &&
+                (i == 0 || editor_is_separator((unsigned char) s[i-1])) &&
+                !memcmp(&s[i], syn->comment, sclen))
+            return state;
+        if (c == syn->mlstart[0] && len - i >= mslen &&
+                !memcmp(&s[i], syn->mlstart, mslen)) {
+            i += mslen;
+            state = 1;
+        } else if (strings && (c == '"' || c == '\'')) {
+            for (i++; i < len && s[i] != c; i++)
+                if (s[i] == '\\' && i + 1 < len)
+                    i++;
+            i++;
+        } else {
+            i++;
+        }
+    }
+    return state;
+}
+
+/* Make the scratch buffers hold a row of n bytes. */
+void
+editor_hl_reserve(int n)
+{
+    if (n < E.hlcap)
+        return;
+    E.hlcap = n + 1 > 2 * E.hlcap ? n + 1 : 2 * E.hlcap;
+    E.hlbuf = realloc(E.hlbuf, E.hlcap);
+    E.hltext = realloc(E.hltext, E.hlcap);
+    if (E.hlbuf == NULL || E.hltext == NULL)
+        die("realloc");
+}
+
+/* A row's chars as one run of bytes for the lexer: a gap row is copied
+   out into E.hltext first. */
+const char *
+editor_row_text(erow * row)
+{
+    editor_hl_reserve(row->size);
+    if (!(row->flags & ROW_GAP))
+        return editor_row_buf(row);
+    editor_row_copy(row, 0, row->size, E.hltext);
+    return E.hltext;
+}
+
+/* Row y changed or was inserted or deleted: the rows from y on may end in
+   a different state now. */
+void
+editor_hl_invalidate(int y)
+{
+    if (y < E.hlrows)
+        E.hlrows = y;
+}
+
+/* The state row y starts in. The rows from E.hlrows down to y are brought
+   up to date first, but only the ones that changed, or that start in a
+   different state than they were lexed in, are lexed again: after an edit
+   that stops as soon as the states converge. */
+int
+editor_hl_state(int y)
+{
+    struct rowiter it;
+    erow * row;
+    int state;
+
+    if (y == 0 || E.syntax->mlstart == NULL)
+        return 0;
+    if (E.hlrows >= y)
+        return rows_at(y - 1)->hlout;
+    state = E.hlrows == 0 ? 0 : rows_at(E.hlrows - 1)->hlout;
+    for (row = rows_iter_begin(&it, E.hlrows); E.hlrows < y; row = rows_iter_next(&it)) {
+        if ((row->flags & ROW_LEX_DIRTY) || row->hlin != state) {
+            row->hlout = editor_lex_state(E.syntax, editor_row_text(row), row->size, state);
+            row->hlin = state;
+            row->flags &= ~(ROW_LEX_DIRTY | ROW_HL_VALID);
+        }
+        state = row->hlout;
+        E.hlrows++;
+    }
+    return state;
+}
+
+/* The highlighting of row y, whose render must be up to date. It is kept
+   in the render block and only lexed again when the row or the state
+   it starts in changes. A tab-free gap row has no render to keep it in
+   and is lexed into E.hlbuf each time it is drawn. */
+unsigned char *
+editor_row_hl(erow * row, int y)
+{
+    int state = editor_hl_state(y);
+    unsigned char * hl;
+    int rsize;
+
+    if ((row->flags & ROW_GAP) && !(row->flags & ROW_COMPLEX)) {
+        const char * text = editor_row_text(row);
+        row->hlout = editor_lex(E.syntax, text, row->size, state, E.hlbuf);
+        row->hlin = state;
+        row->flags &= ~ROW_LEX_DIRTY;
+        return E.hlbuf;
+    }
+    rsize = editor_row_rsize(row);
+    hl = (unsigned char *) &row->render[sizeof(struct renderhead) +
+        (row->flags & ROW_PLAIN ? 0 : rsize + 1)];
+    if (!(row->flags & ROW_HL_VALID) || row->hlin != state) {
+        row->hlout = editor_lex(E.syntax, editor_row_rtext(row), rsize, state, hl);
+        row->hlin = state;
+        row->flags = (row->flags | ROW_HL_VALID) & ~ROW_LEX_DIRTY;
+    }
+    return hl;
+}
+
+/* Pick the syntax for E.filename, by its name or, failing that, by a #!
+   line naming a shell. */
+void
+editor_select_syntax()
+{
+    struct editor_syntax * syn = NULL;
+    struct rowiter it;
+    erow * row;
+    const char * ext;
+    unsigned j;
+    int i;
+
+    if (E.filename) {
+        ext = strrchr(E.filename, '.');
+        for (j = 0; j < HLDB_ENTRIES && syn == NULL; j++) {
+            for (i = 0; HLDB[j].filematch[i] && syn == NULL; i++) {
+                const char * m = HLDB[j].filematch[i];
+                if (m[0] == '.' ? ext && !strcmp(ext, m) : strstr(E.filename, m) != NULL)
+                    syn = &HLDB[j];
+            }
+        }
+    }
+    if (syn == NULL && E.numrows > 0) {
+        char line[64];
+        row = rows_at(0);
+        i = row->size < (int) sizeof(line) - 1 ? row->size : (int) sizeof(line) - 1;
+        editor_row_copy(row, 0, i, line);
+        line[i] = '\0';
+        if (!strncmp(line, "#!", 2) && strstr(line, "sh") != NULL)
+            syn = &HLDB[1];     /* sh */
+    }
+    if (syn == E.syntax)
+        return;
+    if (E.syntax != NULL)
+        for (row = rows_iter_begin(&it, 0); row; row = rows_iter_next(&it))
+            row->flags = (row->flags | ROW_LEX_DIRTY) & ~ROW_HL_VALID;
+    E.syntax = syn;
+    E.hlrows = 0;
+}
+
+/*** row operations ***/
+
+/* Where the character at column at of row ends. A byte that is not valid
+   UTF-8 counts as a character of its own. */
+int
+editor_row_next_char(erow * row, int at)
+{
+    char buf[4];
+    int n = row->size - at < 4 ? row->size - at : 4;
+    int cp;
+
+    editor_row_copy(row, at, n, buf);
+    n = utf8_decode(buf, n, &cp);
+    return at + (n ? n : 1);
+}
+
+/* Where the character that ends at column at of row starts. */
+int
+editor_row_prev_char(erow * row, int at)
+{
+    char buf[4];
+    int n = at < 4 ? at : 4;
+    int j, cp;
+
+    editor_row_copy(row, at - n, n, buf);
+    for (j = n - 1; j > 0 && (buf[j] & 0xC0) == 0x80; j--)
+        continue;
+    return utf8_decode(&buf[j], n - j, &cp) == n - j ? at - (n - j) : at - 1;
+}
+
+/* Column at of row, moved back to the start of the character it is in
+   the middle of, if any. */
+int
+editor_row_char_start(erow * row, int at)
+{
+    char c;
+    int j = at;
+
+    while (j < row->size && j > 0 && at - j < 3) {
+        editor_row_copy(row, j, 1, &c);
+        if ((c & 0xC0) != 0x80)
+            break;
+        j--;
+    }
+    return j < at && editor_row_next_char(row, j) > at ? j : at;
+}
+
+void
+editor_insert_row(int at, char * s, size_t len)
+{
+    erow row;
+    char * undo;
+
+    if (at < 0 || at > E.numrows)
+        return;
+    if ((undo = undo_add(UNDO_INS_ROW, at, 0, len)) != NULL)
+        memcpy(undo, s, len);
+
+    row.size = len;
+    row.flags = len <= ROW_INLINE_MAX ? ROW_INLINE : 0;
+    if (!(row.flags & ROW_INLINE))
+        row.chars.p = (char *) (editor_rowbuf_alloc(len + 1) + 1);
+    memcpy(editor_row_buf(&row), s, len);
+    editor_row_buf(&row)[len] = '\0';
+
+    row.hlin = row.hlout = 0;
+    row.render = NULL;
+    editor_update_row(&row);
+
+    rows_insert(at, &row);
+    editor_hl_invalidate(at);
+    E.numrows++;
+    E.dirty++;
+}
+
+void
+editor_free_row(erow * row)
+{
+    editor_render_free(row);
+    editor_row_free_chars(row);
+}
+
+/* Make sure row owns a chars buffer with room for n bytes. Rows loaded by
+   editor_open point straight into the file mapping and frozen rows are
+   still being saved, so this is also what gives a row its own copy before
+   anything writes to it. A copy short enough goes inline. */
+void
+editor_row_reserve(erow * row, size_t n)
+{
+    int shared = (row->flags & ROW_MAPPED) || editor_row_frozen(row);
+    size_t cap = editor_row_cap(row);
+    struct rowbuf * b;
+
+    if (!shared && n <= cap)
+        return;
+    if (n < (size_t) row->size + 1)
+        n = row->size + 1;
+    if (n <= ROW_INLINE_MAX + 1 && !(row->flags & ROW_GAP)) {
+        char in[ROW_INLINE_MAX + 1];
+        memcpy(in, editor_row_buf(row), row->size);
+        in[row->size] = '\0';
+        editor_row_free_chars(row);
+        memcpy(row->chars.in, in, sizeof(in));
+        row->flags = (row->flags & ~(ROW_MAPPED | ROW_FROZEN)) | ROW_INLINE;
+        return;
+    }
+    if (!shared && !(row->flags & ROW_INLINE) &&
+            arena_class(sizeof(*b) + n) == ARENA_BIG &&
+            arena_class(sizeof(*b) + cap) == ARENA_BIG) {
+        size_t size = arena_round(sizeof(*b) + n);
+        b = realloc(editor_row_head(row), size);
+        if (b == NULL)
+            die("realloc");
+        b->cap = size - sizeof(*b);
+        E.arena.nsys++;
+    } else {
+        b = editor_rowbuf_alloc(n);
+        memcpy(b + 1, editor_row_buf(row), row->size);
+        ((char *) (b + 1))[row->size] = '\0';
+        editor_row_free_chars(row);
+    }
+    row->chars.p = (char *) (b + 1);
+    row->flags &= ~(ROW_MAPPED | ROW_FROZEN | ROW_INLINE);
+}
+
+/* Switch a long row over to being edited as a gap buffer. */
+void
+editor_row_make_gap(erow * row)
+{
+    int n = row->size + GAP_MIN;
+
+    /* too big to go inline: a gap row has a buffer of its own */
+    editor_row_reserve(row, n > ROW_INLINE_MAX + 1 ? n : ROW_INLINE_MAX + 2);
+    editor_row_head(row)->gap = row->size;
+    row->flags |= ROW_GAP;
+    editor_row_update_complex(row);
+    if (!(row->flags & ROW_COMPLEX)) {
+        /* drawn straight from chars from now on */
+        editor_render_free(row);
+        row->flags |= ROW_RENDER_DIRTY;
+    }
+}
+
+void
+editor_del_row(int at)
+{
+    erow row;
+    char * undo;
+
+    if (at < 0 || at >= E.numrows)
+        return;
+    if ((undo = undo_add(UNDO_DEL_ROW, at, 0, rows_at(at)->size)) != NULL)
+        editor_row_copy(rows_at(at), 0, rows_at(at)->size, undo);
+    rows_delete(at, &row);
+    editor_hl_invalidate(at);
+    editor_free_row(&row);
+    E.numrows--;
+    E.dirty++;
+}
+
+void
+editor_row_insert_char(int y, int at, int c)
+{
+    erow * row = rows_at(y);
+    char * undo;
+
+    if (at < 0 || at > row->size)
+        at = row->size;
+    if ((undo = undo_add(UNDO_INS, y, at, 1)) != NULL)
+        *undo = c;
+    if (!(row->flags & ROW_GAP) && row->size + 1 >= GAP_THRESHOLD)
+        editor_row_make_gap(row);
+    if (row->flags & ROW_GAP) {
+        char ch = c;
+        editor_row_gap_insert(row, at, &ch, 1);
+    } else {
+        char * chars;
+        editor_row_reserve(row, row->size + 2);
+        chars = editor_row_buf(row);
+        memmove(&chars[at + 1], &chars[at], row->size - at + 1);
+        row->size++;
+        chars[at] = c;
+    }
+    rows_resized(y, 1);
+    editor_hl_invalidate(y);
+    editor_update_row(row);
+    E.dirty++;
+}
+
+void
+editor_row_insert_string(int y, int at, char * s, size_t len)
+{
+    erow * row = rows_at(y);
+    char * undo;
+
+    if (len == 0)
+        return;
+    if (at < 0 || at > row->size)
+        at = row->size;
+    if ((undo = undo_add(UNDO_INS, y, at, len)) != NULL)
+        memcpy(undo, s, len);
+    if (!(row->flags & ROW_GAP) && row->size + len >= GAP_THRESHOLD)
+        editor_row_make_gap(row);
+    if (row->flags & ROW_GAP) {
+        editor_row_gap_insert(row, at, s, len);
+    } else {
+        char * chars;
+        editor_row_reserve(row, row->size + len + 1);
+        chars = editor_row_buf(row);
+        memmove(&chars[at + len], &chars[at], row->size - at + 1);
+        memcpy(&chars[at], s, len);
+        row->size += len;
+    }
+    rows_resized(y, len);
+    editor_hl_invalidate(y);
+    editor_update_row(row);
+    E.dirty++;
+}
+
+void
+editor_row_append_string(int y, char * s, size_t len)
+{
+    editor_row_insert_string(y, rows_at(y)->size, s, len);
+}
+
+/* Delete len bytes of row y from column at. */
+void
+editor_row_del_string(int y, int at, int len)
+{
+    erow * row = rows_at(y);
+    char * undo;
+
+    if (at < 0 || len <= 0 || at + len > row->size)
+        return;
+    if ((undo = undo_add(UNDO_DEL, y, at, len)) != NULL)
+        editor_row_copy(row, at, len, undo);
+    if (row->flags & ROW_GAP) {
+        editor_row_gap_delete(row, at, len);
+    } else {
+        char * chars;
+        editor_row_reserve(row, row->size + 1);
+        chars = editor_row_buf(row);
+        memmove(&chars[at], &chars[at + len], row->size - at - len + 1);
+        row->size -= len;
+    }
+    rows_resized(y, -len);
+    editor_hl_invalidate(y);
+    editor_update_row(row);
+    E.dirty++;
+}
+
+void
+editor_row_del_char(int y, int at)
+{
+    editor_row_del_string(y, at, 1);
+}
+
+void
+editor_insert_char(int c)
+{
+    if (E.cy == E.numrows) {
+        editor_insert_row(E.numrows, "", 0);
+    }
+    editor_row_insert_char(E.cy, E.cx, c);
+    E.cx++;
+}
+
+void
+editor_insert_new_line()
+{
+    if (E.cx == 0) {
+        editor_insert_row(E.cy, "", 0);
+    } else {
+        erow * row = rows_at(E.cy);
+        char * chars = editor_row_chars(row);
+        char * undo;
+        editor_insert_row(E.cy + 1, &chars[E.cx], row->size - E.cx);
+        row = rows_at(E.cy); /* needed because editor_insert_row moves rows! */
+        if (row->size > E.cx &&
+                (undo = undo_add(UNDO_DEL, E.cy, E.cx, row->size - E.cx)) != NULL)
+            editor_row_copy(row, E.cx, row->size - E.cx, undo);
+        editor_row_reserve(row, row->size + 1);
+        rows_resized(E.cy, E.cx - row->size);
+        editor_hl_invalidate(E.cy);
+        row->size = E.cx;
+        editor_row_buf(row)[row->size] = '\0';
+        if (row->flags & ROW_GAP) {
+            editor_row_head(row)->gap = row->size;
+            editor_row_update_complex(row);
+        }
+        editor_update_row(row);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+/* Returns the first line break in [s, end), or end. */
+char *
+editor_find_break(char * s, char * end)
+{
+    while (s < end && *s != '\r' && *s != '\n')
+        s++;
+    return s;
+}
+
+/* Insert pasted text at the cursor, a line at a time instead of a key at a
+   time. Terminals send pasted newlines as \r, so \r\n, \r and \n all end a
+   line. */
+void
+editor_insert_text(char * s, int len)
+{
+    char * end = s + len;
+    char * nl;
+
+    if (len == 0)
+        return;
+    if (E.cy == E.numrows)
         editor_insert_row(E.numrows, "", 0);
+
+    nl = editor_find_break(s, end);
+    editor_row_insert_string(E.cy, E.cx, s, nl - s);
+    E.cx += nl - s;
+    if (nl == end)
+        return;
+
+    /* the rest of the row moves down and the pasted lines go in above it */
+    editor_insert_new_line();
+    while (nl != end) {
+        s = nl + (nl[0] == '\r' && nl + 1 < end && nl[1] == '\n' ? 2 : 1);
+        nl = editor_find_break(s, end);
+        if (nl == end)
+            break;
+        editor_insert_row(E.cy, s, nl - s);
+        E.cy++;
+    }
+    editor_row_insert_string(E.cy, 0, s, end - s);
+    E.cx = end - s;
+}
+
+void
+editor_del_char()
+{
+    erow * row;
+    if (E.cy == E.numrows)
+        return;
+    if (E.cx == 0 && E.cy == 0)
+        return;
+    row = rows_at(E.cy);
+    if (E.cx > 0) {
+        int at = editor_row_prev_char(row, E.cx);
+        editor_row_del_string(E.cy, at, E.cx - at);
+        E.cx = at;
+    } else {
+        E.cx = rows_at(E.cy - 1)->size;
+        editor_row_append_string(E.cy - 1, editor_row_chars(row), row->size);
+        editor_del_row(E.cy);
+        E.cy--;
+    }
+}
+
+void
+editor_scroll()
+{
+    E.rx = E.cx;
+    if (E.cy < E.numrows) {
+        E.rx = editor_row_cx_to_rx(rows_at(E.cy), E.cx);
+    }
+
+    if (E.cy < E.rowoff) {
+        E.rowoff = E.cy;
+    }
+    if (E.cy >= E.rowoff + E.screenrows) {
+        E.rowoff = E.cy - E.screenrows + 1;
+    }
+    if (E.rx < E.coloff) {
+        E.coloff = E.rx;
+    }
+    if (E.rx >= E.coloff + E.screencols) {
+        E.coloff = E.rx - E.screencols + 1;
+    }
+}
+
+/*** buffers ***/
+
+/* Keep the cursor on the buffer after it changed while out of sight, by
+   being edited through another window or appended to while followed. */
+void
+editor_clamp_cursor()
+{
+    erow * row;
+
+    if (E.cy > E.numrows)
+        E.cy = E.numrows;
+    if ((row = rows_at(E.cy)) == NULL)
+        E.cx = 0;
+    else if (E.cx > row->size)
+        E.cx = row->size;
+    else
+        E.cx = editor_row_char_start(row, E.cx);
+}
+
+void
+editor_buffer_store(struct buffer * b)
+{
+    b->rows = E.rows;
+    b->numrows = E.numrows;
+    b->rowcache = E.rowcache;
+    b->rowcache_start = E.rowcache_start;
+    b->dirty = E.dirty;
+    b->filename = E.filename;
+    b->map = E.map;
+    b->maplen = E.maplen;
+    b->arena = E.arena;
+    b->undo = E.undo;
+    b->follow = E.follow;
+    b->syntax = E.syntax;
+    b->hlrows = E.hlrows;
+    b->cx = E.cx;
+    b->cy = E.cy;
+    b->rowoff = E.rowoff;
+    b->coloff = E.coloff;
+}
+
+void
+editor_buffer_load(struct buffer * b)
+{
+    E.rows = b->rows;
+    E.numrows = b->numrows;
+    E.rowcache = b->rowcache;
+    E.rowcache_start = b->rowcache_start;
+    E.dirty = b->dirty;
+    E.filename = b->filename;
+    E.map = b->map;
+    E.maplen = b->maplen;
+    E.arena = b->arena;
+    E.undo = b->undo;
+    E.follow = b->follow;
+    E.syntax = b->syntax;
+    E.hlrows = b->hlrows;
+    E.cx = b->cx;
+    E.cy = b->cy;
+    E.rowoff = b->rowoff;
+    E.coloff = b->coloff;
+}
+
+/* Make buffer j the current one. This only copies a few fields, so it is
+   cheap enough to do for every window drawn. */
+void
+editor_buffer_select(int j)
+{
+    if (j == E.curbuf)
+        return;
+    editor_buffer_store(&E.bufs[E.curbuf]);
+    editor_buffer_load(&E.bufs[j]);
+    E.curbuf = j;
+    editor_clamp_cursor();
+}
+
+/* Add an empty buffer and make it current. */
+void
+editor_buffer_new()
+{
+    struct buffer * b;
+
+    if (E.nbufs == E.bufcap) {
+        E.bufcap = E.bufcap ? E.bufcap * 2 : 4;
+        E.bufs = realloc(E.bufs, sizeof(struct buffer) * E.bufcap);
+        if (E.bufs == NULL)
+            die("realloc");
+    }
+    b = &E.bufs[E.nbufs];
+    memset(b, 0, sizeof(*b));
+    b->follow.fd = b->follow.wd = b->follow.file = -1;
+    b->undo.cap = E.undo.cap;
+    if (E.nbufs > 0)
+        editor_buffer_store(&E.bufs[E.curbuf]);
+    editor_buffer_load(b);
+    E.curbuf = E.nbufs++;
+}
+
+char *
+editor_buffer_name(int j)
+{
+    return j == E.curbuf ? E.filename : E.bufs[j].filename;
+}
+
+/* Number of buffers with unsaved changes. */
+int
+editor_buffers_dirty()
+{
+    int n = 0;
+    int j;
+
+    for (j = 0; j < E.nbufs; j++)
+        if (j == E.curbuf ? E.dirty : E.bufs[j].dirty)
+            n++;
+    return n;
+}
+
+/*** windows ***/
+
+void
+editor_window_store()
+{
+    struct window * w = &E.wins[E.curwin];
+
+    w->buf = E.curbuf;
+    w->cx = E.cx;
+    w->cy = E.cy;
+    w->rx = E.rx;
+    w->rowoff = E.rowoff;
+    w->coloff = E.coloff;
+    w->frame_rowoff = E.frame_rowoff;
+}
+
+void
+editor_window_load(int j)
+{
+    struct window * w = &E.wins[j];
+
+    editor_buffer_select(w->buf);
+    E.curwin = j;
+    E.cx = w->cx;
+    E.cy = w->cy;
+    E.rx = w->rx;
+    E.rowoff = w->rowoff;
+    E.coloff = w->coloff;
+    E.frame_rowoff = w->frame_rowoff;
+    E.screentop = w->top;
+    E.screenrows = w->rows;
+    editor_clamp_cursor();
+}
+
+/* Swap window j in for the focused one, along with its buffer. */
+void
+editor_window_enter(int j)
+{
+    if (j == E.curwin)
+        return;
+    editor_window_store();
+    editor_window_load(j);
+}
+
+/* Add a window under the focused one showing the same view, and focus
+   it. The caller lays the screen out again. */
+void
+editor_window_add()
+{
+    if (E.nwins == E.wincap) {
+        E.wincap = E.wincap ? E.wincap * 2 : 4;
+        E.wins = realloc(E.wins, sizeof(struct window) * E.wincap);
+        if (E.wins == NULL)
+            die("realloc");
+    }
+    if (E.nwins > 0) {
+        editor_window_store();
+        memmove(&E.wins[E.curwin + 1], &E.wins[E.curwin],
+                sizeof(struct window) * (E.nwins - E.curwin));
+        E.curwin++;
+    } else {
+        memset(&E.wins[0], 0, sizeof(struct window));
+        E.curwin = 0;
+    }
+    E.nwins++;
+    editor_window_store();
+}
+
+/* Drop window j, which is not the focused one. */
+void
+editor_window_remove(int j)
+{
+    memmove(&E.wins[j], &E.wins[j + 1], sizeof(struct window) * (E.nwins - j - 1));
+    E.nwins--;
+    if (E.curwin > j)
+        E.curwin--;
+}
+
+/* Share the lines left over by the status bars and the message bar out
+   evenly between the windows. While there are not enough to go round,
+   windows are dropped from the bottom. */
+void
+editor_layout()
+{
+    int avail, top = 0;
+    int j;
+
+    while (E.nwins > 1 && E.termrows - 1 - E.nwins < E.nwins)
+        editor_window_remove(E.curwin == E.nwins - 1 ? E.nwins - 2 : E.nwins - 1);
+    avail = E.termrows - 1 - E.nwins;
+    for (j = 0; j < E.nwins; j++) {
+        struct window * w = &E.wins[j];
+        w->top = top;
+        w->rows = avail / E.nwins + (j < avail % E.nwins);
+        if (w->rows < 1)
+            w->rows = 1;
+        /* nothing on screen is worth scrolling into the new place */
+        w->frame_rowoff = w->rowoff;
+        top += w->rows + 1;
+    }
+    /* the message bar goes on the last line */
+    if (E.termrows < top + 1)
+        E.termrows = top + 1;
+    E.screentop = E.wins[E.curwin].top;
+    E.screenrows = E.wins[E.curwin].rows;
+    E.frame_rowoff = E.rowoff;
+}
+
+void
+editor_set_window_size(int rows, int cols)
+{
+    E.termrows = rows;
+    E.screencols = cols;
+    editor_layout();
+}
+
+/*** output ***/
+
+/* The terminal is only sent the screen lines that differ from what it
+   already shows. Each line is composed into a scratch buffer and compared,
+   by hash, with the line drawn there last time; unchanged lines cost
+   nothing beyond the hashing. */
+
+unsigned long
+frame_hash(struct abuf * ab)
+{
+    unsigned long h = 2166136261UL;
+    int j, k;
+
+    for (j=0; j<ab->nseg; j++) {
+        struct abseg * seg = &ab->seg[j];
+        const char * s = seg->p ? seg->p : &ab->b[seg->off];
+        for (k=0; k<seg->len; k++) {
+            h ^= (unsigned char) s[k];
+            h *= 16777619UL;
+        }
+    }
+    return h;
+}
+
+/* Forget what is on screen so the next refresh repaints every line. */
+void
+editor_invalidate_frame()
+{
+    int y;
+
+    for (y=0; y<E.framelines; y++)
+        E.frame[y].valid = 0;
+}
+
+/* Write line to screen line y, unless y already shows exactly that. */
+void
+editor_emit_line(struct abuf * ab, struct abuf * line, int y)
+{
+    unsigned long hash = frame_hash(line);
+    char buf[32];
+
+    if (E.frame[y].valid && E.frame[y].hash == hash)
+        return;
+    E.frame[y].valid = 1;
+    E.frame[y].hash = hash;
+
+    if (y == E.frame_lasty + 1) {
+        ab_append(ab, "\r\n", 2);
+    } else {
+        snprintf(buf, sizeof(buf), ESC "[%d;1H", y + 1);
+        ab_append(ab, buf, strlen(buf));
+    }
+    E.frame_lasty = y;
+    ab_append_abuf(ab, line);
+    ab_append(ab, CLR_ROW, CLR_ROW_LEN);
+}
+
+/* When E.rowoff moved by less than a window since the last frame, let the
+   terminal scroll the lines it already has instead of resending them. */
+void
+editor_scroll_frame(struct abuf * ab)
+{
+    int d = E.rowoff - E.frame_rowoff;
+    int n = E.screenrows;
+    struct frame_line * frame = &E.frame[E.screentop];
+    char buf[48];
+    int y;
+
+    E.frame_rowoff = E.rowoff;
+    if (d == 0 || d >= n || d <= -n)
+        return;
+
+    snprintf(buf, sizeof(buf), ESC "[%d;%dr" ESC "[%d%c", E.screentop + 1,
+            E.screentop + n, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+    ab_append(ab, buf, strlen(buf));
+    ab_append(ab, RESET_SCROLL_REGION, RESET_SCROLL_REGION_LEN);
+    /* which homes the cursor, so the next line needs an absolute move */
+    E.frame_lasty = -2;
+
+    if (d > 0) {
+        memmove(&frame[0], &frame[d], sizeof(struct frame_line) * (n - d));
+        for (y = n - d; y < n; y++)
+            frame[y].valid = 0;
+    } else {
+        memmove(&frame[-d], &frame[0], sizeof(struct frame_line) * (n + d));
+        for (y = 0; y < -d; y++)
+            frame[y].valid = 0;
+    }
+}
+
+/* Append len bytes of a highlighted row from column at, from render or,
+   for a tab-free gap row, straight from chars. An escape is only written
+   where the colour changes, so a run of one colour costs one. */
+void
+editor_append_hl(struct abuf * ab, erow * row, const char * render,
+        const unsigned char * hl, int at, int len)
+{
+    const char * color = HL_DEFAULT_COLOR;
+    int start = 0;
+    int j;
+
+    for (j = 0; j <= len; j++) {
+        if (j < len && hl_colors[hl[at + j]] == color)
+            continue;
+        if (j > start) {
+            if (render)
+                ab_append_ref(ab, &render[at + start], j - start);
+            else
+                ab_append_gap(ab, row, at + start, j - start);
+        }
+        if (j < len) {
+            color = hl_colors[hl[at + j]];
+            ab_append(ab, color, strlen(color));
+            start = j;
+        }
+    }
+    if (color != HL_DEFAULT_COLOR)
+        ab_append(ab, HL_DEFAULT_COLOR, strlen(HL_DEFAULT_COLOR));
+}
+
+void
+editor_draw_rows(struct abuf * ab)
+{
+    struct rowiter it;
+    erow * row = rows_iter_begin(&it, E.rowoff);
+    struct rownode * leaf = NULL;
+    struct abuf * line = &E.line;
+    int y;
+    for (y = 0; y < E.screenrows; y++) {
+        ab_reset(line);
+        if (row != NULL && it.leaf != leaf) {
+            leaf = it.leaf;
+            rows_lru_touch(leaf);
+        }
+        if (row == NULL) {
+            if (E.numrows == 0 && y == E.screenrows / 3) {
+                int padding;
+                char welcome[80];
+                int welcomelen = snprintf(welcome, sizeof(welcome), "ped editor -- version %s", "1.0");
+                if (welcomelen > E.screencols)
+                    welcomelen = E.screencols;
+                padding = (E.screencols - welcomelen) / 2;
+                if (padding) {
+                    ab_append(line, "~", 1);
+                    padding--;
+                }
+                while (padding--)
+                    ab_append(line, " ", 1);
+                ab_append(line, welcome, welcomelen);
+            } else {
+                ab_append(line, "~", 1);
+            }
+        } else if ((row->flags & ROW_GAP) && !(row->flags & ROW_COMPLEX)) {
+            /* A tab-free gap row renders as itself, so draw the visible
+               span straight out of the gap buffer. */
+            int len = row->size - E.coloff;
+            if (len < 0)
+                len = 0;
+            if (len > E.screencols)
+                len = E.screencols;
+            if (E.syntax)
+                editor_append_hl(line, row, NULL, editor_row_hl(row, E.rowoff + y),
+                        E.coloff, len);
+            else
+                ab_append_gap(line, row, E.coloff, len);
+            row = rows_iter_next(&it);
+        } else {
+            char * render = editor_row_render(row);
+            int at = E.coloff;
+            int len, pad;
+            if (row->flags & ROW_UTF8) {
+                int rb = 0, rx = 0;
+                if (row->flags & ROW_COLMAP) {
+                    struct colmark * m = editor_colmap_find(row, E.coloff, 1);
+                    rb = m->rb;
+                    rx = m->rx;
+                }
+                len = utf8_span(&render[rb], editor_row_rsize(row) - rb, E.coloff - rx,
+                        E.screencols, &at, &pad) - at;
+                at += rb;
+                while (pad-- > 0)
+                    ab_append(line, " ", 1);
+            } else {
+                len = editor_row_rsize(row) - E.coloff;
+                if (len < 0)
+                    len = 0;
+                if (len > E.screencols)
+                    len = E.screencols;
+            }
+            if (E.syntax)
+                editor_append_hl(line, row, render, editor_row_hl(row, E.rowoff + y),
+                        at, len);
+            else
+                ab_append_ref(line, &render[at], len);
+            row = rows_iter_next(&it);
+        }
+        editor_emit_line(ab, line, E.screentop + y);
+    }
+}
+
+/* The syntax and where the cursor is, for the right of the status bar. */
+int
+editor_pos_status(char * buf, int size)
+{
+    int len = 0;
+
+    if (E.syntax)
+        len = snprintf(buf, size, "%s | ", E.syntax->name);
+    return len + snprintf(&buf[len], size - len, "%d/%d", E.cy + 1, E.numrows);
+}
+
+/* "match N of M" while searching. N is only known once every chunk before
+   the match has been counted, M once the whole file has. */
+int
+editor_find_status(char * buf, int size)
+{
+    struct find_state * f = &E.find;
+    int len = 0;
+    long before = 0;
+    int j;
+
+    if (f->active && f->bad) {
+        len = snprintf(buf, size, "bad regex | ");
+    } else if (f->active && f->qlen > 0) {
+        pthread_mutex_lock(&f->lock);
+        if (f->y == -1 && f->ndone == f->nchunks) {
+            len = snprintf(buf, size, "no matches | ");
+        } else if (f->y != -1) {
+            for (j = 0; j < f->y / FIND_CHUNK && before != -1; j++)
+                before = f->count[j] < 0 ? -1 : before + f->count[j];
+            if (before == -1)
+                len = snprintf(buf, size, "match ? of ");
+            else
+                len = snprintf(buf, size, "match %ld of ", before + f->rank + 1);
+            len += snprintf(&buf[len], size - len, f->ndone == f->nchunks ?
+                    "%ld | " : "%ld+ | ", f->total);
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    return len + editor_pos_status(&buf[len], size - len);
+}
+
+/* The bar under a window. Searching and profiling are only reported
+   under the focused one. */
+void
+editor_draw_status_bar(struct abuf * ab, int focused)
+{
+    char status[80];
+    char rstatus[80];
+    int len = 0;
+    int rlen = !focused ? editor_pos_status(rstatus, sizeof(rstatus)) :
+        E.prof.on ? prof_status(rstatus, sizeof(rstatus)) :
+        editor_find_status(rstatus, sizeof(rstatus));
+    struct abuf * line = &E.line;
+
+    if (E.nbufs > 1)
+        len = snprintf(status, sizeof(status), "[%d/%d] ", E.curbuf + 1, E.nbufs);
+    len += snprintf(&status[len], sizeof(status) - len, "%.20s - %d lines %s%s",
+            E.filename ? E.filename : "[No Name]", E.numrows,
+            E.dirty ? "(modified) " : "", E.follow.active ? "(following)" : "");
+    ab_reset(line);
+
+    if (len > E.screencols)
+        len = E.screencols;
+
+    ab_append(line, status, len);
+
+    ab_append(line, INV_COLOR, INV_COLOR_LEN);
+    while (len < E.screencols) {
+        if (E.screencols - len == rlen) {
+            ab_append(line, rstatus, rlen);
+            break;
+        } else {
+            ab_append(line, " ", 1);
+            len++;
+        }
+    }
+    ab_append(line, NORMAL_COLOR, NORMAL_COLOR_LEN);
+    editor_emit_line(ab, line, E.screentop + E.screenrows);
+}
+
+void
+editor_draw_message_bar(struct abuf * ab)
+{
+    int msglen = strlen(E.statusmsg);
+    struct abuf * line = &E.line;
+
+    ab_reset(line);
+    if (msglen > E.screencols)
+        msglen = E.screencols;
+    if (msglen && time(NULL) - E.statusmsg_time < MSG_TIMEOUT)
+        ab_append(line, E.statusmsg, msglen);
+    editor_emit_line(ab, line, E.termrows - 1);
+}
+
+void
+editor_handle_resize()
+{
+    int rows, cols;
+
+    if (get_window_size(&rows, &cols) == -1)
+        die("get_window_size");
+    editor_set_window_size(rows, cols);
+    editor_invalidate_frame();
+}
+
+/* Free the render blocks of the leaves drawn least recently until the
+   cache is back under its cap. Leaves drawn in this frame are kept
+   whatever the cap, and this only runs once the frame is written, since
+   until then it refers to render blocks. */
+void
+editor_render_trim()
+{
+    struct render_cache * c = &E.rcache;
+
+    while (c->bytes > c->cap && c->oldest && c->oldest->drawn != c->frame) {
+        struct rownode * leaf = c->oldest;
+        int j;
+
+        for (j = 0; j < leaf->n; j++)
+            editor_row_evict(&leaf->u.rows[j]);
+        rows_lru_unlink(leaf);
+        c->ntrim++;
+    }
+    c->frame++;
+}
+
+void
+editor_refresh_screen()
+{
+    struct abuf * ab = &E.out;
+    char buf[32];
+    double t0 = prof_start(), t;
+    int focus, j;
+
+    if (E.resized) {
+        E.resized = 0;
+        editor_handle_resize();
+    }
+    focus = E.curwin;
+    editor_scroll();
+    t = prof_lap(PROF_SCROLL, t0);
+
+    if (E.framelines != E.termrows) {
+        struct frame_line * frame = realloc(E.frame, sizeof(struct frame_line) * E.termrows);
+
+        if (frame == NULL)
+            die("realloc");
+        E.frame = frame;
+        E.framelines = E.termrows;
+        editor_invalidate_frame();
+    }
+
+    ab_reset(ab);
+    ab_append(ab, HIDE_CUR, HIDE_CUR_LEN);
+
+    /* the other windows are drawn by swapping each in for a moment */
+    E.frame_lasty = -2;
+    for (j = 0; j < E.nwins; j++) {
+        editor_window_enter(j);
+        if (j != focus)
+            editor_scroll();
+        editor_scroll_frame(ab);
+        editor_draw_rows(ab);
+        editor_draw_status_bar(ab, j == focus);
+    }
+    editor_window_enter(focus);
+    editor_draw_message_bar(ab);
+
+    snprintf(buf, sizeof(buf), ESC "[%d;%dH", E.screentop + (E.cy - E.rowoff) + 1,
+            (E.rx - E.coloff) + 1);
+    ab_append(ab, buf, strlen(buf));
+
+    ab_append(ab, SHOW_CUR, SHOW_CUR_LEN);
+    t = prof_lap(PROF_DRAW, t);
+
+    ab_write(ab, STDOUT_FILENO);
+    editor_render_trim();
+    t = prof_lap(PROF_WRITE, t);
+    if (t0 > 0 && t > 0)
+        E.prof.inner += t - t0;
+}
+
+void
+editor_set_status_message(const char * fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+    va_end(ap);
+    E.statusmsg_time = time(NULL);
+}
+
+/* Tell the user about a file caught shrinking by editor_handle_sigbus. */
+void
+editor_report_lost()
+{
+    char * name = NULL;
+    int j;
+
+    for (j = 0; j < E.nbufs; j++)
+        if ((j == E.curbuf ? E.map : E.bufs[j].map) == E.lostmap)
+            name = editor_buffer_name(j);
+    E.lostmap = NULL;
+    editor_set_status_message("%.30s shrank on disk: lines past its end read as zeros",
+            name ? name : "A file");
+}
+
+char *
+editor_prompt(char * prompt, void (* callback)(char *, int))
+{
+    size_t bufsize = 128;
+    char * buf = malloc(bufsize);
+
+    size_t buflen = 0;
+    int held = E.follow.held;
+    buf[0] = '\0';
+
+    E.follow.held = 1;
+    while (1) {
+        int c;
+
+        editor_set_status_message(prompt, buf);
+        editor_refresh_screen();
+
+        c = editor_read_key();
+        if (c == KEY_REDRAW)
+            continue;
+        if (c == KEY_DEL || c == CTRL_KEY('h') || c == KEY_BACKSPACE) {
+            if (buflen != 0)
+                buf[--buflen] = '\0';
+        } else if (c == ESC_CHAR) {
+            editor_set_status_message("");
+            if (callback)
+                callback(buf, c);
+            free(buf);
+            E.follow.held = held;
+            return NULL;
+        } else if (c == '\r') {
+            if (buflen != 0) {
+                editor_set_status_message("");
+                if (callback)
+                    callback(buf, c);
+                E.follow.held = held;
+                return buf;
+            }
+        } else if (c == KEY_PASTE) {
+            /* keep the first line of the paste */
+            char * nl = editor_find_break(E.paste, E.paste + E.pastelen);
+            size_t n = nl - E.paste;
+            while (buflen + n >= bufsize) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            memcpy(&buf[buflen], E.paste, n);
+            buflen += n;
+            buf[buflen] = '\0';
+        } else if (!iscntrl(c) && c < 128) {
+            if (buflen == bufsize -1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+
+        if (callback)
+            callback(buf, c);
+    }
+}
+
+/* Make the edit r describes, or undo it. */
+void
+editor_undo_apply(struct undo_rec * r, int undo)
+{
+    char * text = (char *) (r + 1);
+
+    /* each type is undone by its neighbour */
+    switch (undo ? r->type ^ 1 : r->type) {
+        case UNDO_INS:
+            editor_row_insert_string(r->y, r->at, text, r->len);
+            break;
+        case UNDO_DEL:
+            editor_row_del_string(r->y, r->at, r->len);
+            break;
+        case UNDO_INS_ROW:
+            editor_insert_row(r->y, text, r->len);
+            break;
+        case UNDO_DEL_ROW:
+            editor_del_row(r->y);
+            break;
+    }
+}
+
+/* Undo the records of the last keypress, newest first. */
+void
+editor_undo()
+{
+    struct undo_log * u = &E.undo;
+    struct undo_rec * r;
+    int seq;
+
+    if (u->nundo == 0) {
+        editor_set_status_message("Nothing to undo");
+        return;
+    }
+    u->off = 1;
+    seq = undo_at(u->top)->seq;
+    do {
+        r = undo_at(u->top);
+        editor_undo_apply(r, 1);
+        u->nundo--;
+        u->nredo++;
+        if (u->nundo > 0)
+            u->top = r->prev;
+    } while (u->nundo > 0 && undo_at(u->top)->seq == seq);
+    u->off = 0;
+    E.cx = r->cx;
+    E.cy = r->cy;
+}
+
+void
+editor_redo()
+{
+    struct undo_log * u = &E.undo;
+    struct undo_rec * r;
+    int seq;
+
+    if (u->nredo == 0) {
+        editor_set_status_message("Nothing to redo");
+        return;
+    }
+    u->off = 1;
+    seq = undo_at(u->nundo ? undo_at(u->top)->next : u->first)->seq;
+    do {
+        u->top = u->nundo ? undo_at(u->top)->next : u->first;
+        r = undo_at(u->top);
+        editor_undo_apply(r, 0);
+        u->nundo++;
+        u->nredo--;
+    } while (u->nredo > 0 && undo_at(r->next)->seq == seq);
+    u->off = 0;
+    E.cx = r->acx;
+    E.cy = r->acy;
+}
+
+void
+editor_move_cursor(int key)
+{
+    int rowlen;
+    erow * row = rows_at(E.cy);
+
+    switch (key) {
+        case KEY_LEFT:
+            if (E.cx > 0) {
+                E.cx = editor_row_prev_char(row, E.cx);
+            } else if (E.cy > 0) {
+                E.cy--;
+                E.cx = rows_at(E.cy)->size;
+            }
+            break;
+        case KEY_RIGHT:
+            if (row && E.cx < row->size) {
+                E.cx = editor_row_next_char(row, E.cx);
+            } else if (row && E.cx == row->size) {
+                E.cy++;
+                E.cx = 0;
+            }
+            break;
+        case KEY_UP:
+        case KEY_DOWN:
+            /* stay in the same column, E.rx is still the cursor's */
+            if (key == KEY_UP ? E.cy > 0 : E.cy < E.numrows - 1) {
+                E.cy += key == KEY_UP ? -1 : 1;
+                E.cx = editor_row_rx_to_cx(rows_at(E.cy), E.rx);
+            }
+            break;
+    }
+
+    row = rows_at(E.cy);
+    rowlen = row ? row->size : 0;
+    if (E.cx > rowlen)
+        E.cx = rowlen;
+    if (row)
+        E.cx = editor_row_char_start(row, E.cx);
+}
+
+#if 0
+/* TODO: debug */
+ssize_t
+my_getline(char ** s, size_t * cap, FILE * stream)
+{
+    char buf[100];
+    size_t len = 0;
+    buf[99] = '\0';
+    *cap = sizeof(buf);
+    *s = malloc(*cap);
+    (*s)[0] = '\0';
+    while (1) {
+        if (fgets(buf, sizeof(buf), stream) == NULL)
+            break;
+        strncpy(*s + len, buf, sizeof(buf));
+        len = strlen(buf);
+        if (len < sizeof(buf)-1)
+            break;
+        *cap *= 2;
+        *s = realloc(*s, *cap);
+        if (*s == NULL) {
+            perror("getline");
+            exit(EXIT_FAILURE);
+        }
+
+    }
+    return len;
+}
+#endif
+
+/* Load a regular file by mapping it and pointing each row at its line in the
+   mapping. Only newlines are scanned here: chars are copied by
+   editor_row_reserve when a row is first edited and render is built by
+   editor_row_render when a row is first drawn. Returns -1 if the file can't
+   be mapped so the caller can fall back to reading it. If another process
+   truncates the file, rows past its new end are lost: reading them would
+   raise SIGBUS, and editor_handle_sigbus makes them read as zeros. */
+int
+editor_open_mapped(int fd)
+{
+    struct stat st;
+    char * map, * p, * end, * nl;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return -1;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    end = map + st.st_size;
+    for (p = map; p < end; p = nl + 1) {
+        erow row;
+        int linelen;
+
+        nl = memchr(p, '\n', end - p);
+        linelen = (nl ? nl : end) - p;
+        while (linelen > 0 && p[linelen-1] == '\r')
+            linelen--;
+        row.size = linelen;
+        row.flags = ROW_MAPPED | ROW_RENDER_DIRTY | ROW_LEX_DIRTY;
+        row.hlin = row.hlout = 0;
+        row.chars.p = p;
+        row.render = NULL;
+        rows_insert(E.numrows++, &row);
+        if (nl == NULL)
+            break;
+    }
+
+    posix_madvise(map, st.st_size, POSIX_MADV_NORMAL);
+    E.map = map;
+    E.maplen = st.st_size;
+    E.follow.off = st.st_size;
+    E.follow.partial = end[-1] != '\n';
+    return 0;
+}
+
+/* Forget the current file. Chars are not freed one at a time: they go
+   back with the arena's slabs, leaving only oversized blocks, the render
+   blocks, which belong to the render cache, and the tree itself to walk. */
+void
+editor_close()
+{
+    struct rowiter it;
+    erow * row;
+
+    for (row = rows_iter_begin(&it, 0); row; row = rows_iter_next(&it)) {
+        size_t size = sizeof(struct rowbuf) + editor_row_cap(row);
+        editor_render_free(row);
+        if (!(row->flags & (ROW_MAPPED | ROW_INLINE)) && arena_class(size) == ARENA_BIG)
+            arena_free(&E.arena, editor_row_head(row), size);
+    }
+    rows_free(E.rows);
+    E.rows = NULL;
+    E.rowcache = NULL;
+    E.numrows = 0;
+    arena_release(&E.arena);
+    if (E.map) {
+        munmap(E.map, E.maplen);
+        E.map = NULL;
+        E.maplen = 0;
+    }
+    free(E.filename);
+    E.filename = NULL;
+    E.cx = E.cy = E.rx = 0;
+    E.rowoff = E.coloff = 0;
+    E.dirty = 0;
+    E.syntax = NULL;
+    E.hlrows = 0;
+    undo_clear();
+}
+
+/* Copy the chars of every row into a fresh arena so that live blocks are
+   packed together and buffers that grew during editing are trimmed, or
+   moved inline if they got short enough, then release the old slabs.
+   Render blocks are left to the render cache. */
+void
+editor_compact()
+{
+    struct arena old = E.arena;
+    struct rowiter it;
+    struct rowbuf * b;
+    erow * row;
+    size_t size;
+    int big;
+
+    E.arena.slabs = NULL;
+    E.arena.top = NULL;
+    E.arena.left = 0;
+    memset(E.arena.free, 0, sizeof(E.arena.free));
+    E.arena.nslabs = 0;
+    E.arena.live = 0;
+
+    for (row = rows_iter_begin(&it, 0); row; row = rows_iter_next(&it)) {
+        if (row->flags & (ROW_MAPPED | ROW_INLINE))
+            continue;
+        b = editor_row_head(row);
+        size = sizeof(*b) + b->cap;
+        big = arena_class(size) == ARENA_BIG;
+        if (row->flags & ROW_GAP) {
+            /* keep the gap where it is */
+            if (!big) {
+                struct rowbuf * copy = arena_alloc(&E.arena, size);
+                memcpy(copy, b, size);
+                row->chars.p = (char *) (copy + 1);
+            }
+        } else if (row->size <= ROW_INLINE_MAX) {
+            memcpy(row->chars.in, b + 1, row->size + 1);
+            row->flags |= ROW_INLINE;
+            if (big)
+                arena_free(&E.arena, b, size);
+        } else if (!big || arena_round(sizeof(*b) + row->size + 1) != size) {
+            struct rowbuf * copy = editor_rowbuf_alloc(row->size + 1);
+            memcpy(copy + 1, b + 1, row->size + 1);
+            if (big)
+                arena_free(&E.arena, b, size);
+            row->chars.p = (char *) (copy + 1);
+        }
+    }
+    arena_release(&old);
+}
+
+void
+editor_open(char * filename)
+{
+    char * line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    FILE * fp = fopen(filename, "r");
+    editor_close();
+    E.filename = strdup(filename);
+    E.follow.off = 0;
+    E.follow.partial = 0;
+    if (fp == NULL) {
+        editor_select_syntax();
+        return;
+    }
+
+    if (editor_open_mapped(fileno(fp)) == 0) {
+        fclose(fp);
+        E.dirty = 0;
+        editor_select_syntax();
+        return;
+    }
+
+    E.undo.off = 1;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        E.follow.off += linelen;
+        E.follow.partial = line[linelen-1] != '\n';
+        while (linelen > 0 &&
+                (line[linelen-1] == '\n' ||
+                 line[linelen-1] == '\r'))
+            linelen--;
+        editor_insert_row(E.numrows, line, linelen);
+    }
+    E.undo.off = 0;
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+    editor_select_syntax();
+}
+
+void
+editor_follow_stop()
+{
+    struct follow_state * f = &E.follow;
+
+#ifdef __linux__
+    if (f->wd != -1)
+        inotify_rm_watch(f->fd, f->wd);
+#endif
+    f->wd = -1;
+    if (f->file != -1)
+        close(f->file);
+    f->file = -1;
+    f->active = 0;
+}
+
+/* Open the file at E.filename and watch it. The inotify instance is made
+   once and kept; without one the file is polled instead. */
+int
+editor_follow_watch()
+{
+    struct follow_state * f = &E.follow;
+    struct stat st;
+    int file = open(E.filename, O_RDONLY);
+
+    if (file == -1)
+        return -1;
+    if (fstat(file, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(file);
+        errno = EINVAL;
+        return -1;
+    }
+    if (f->file != -1)
+        close(f->file);
+    f->file = file;
+    fcntl(file, F_SETFD, FD_CLOEXEC);
+#ifdef __linux__
+    if (f->fd == -1 && (f->fd = inotify_init()) != -1) {
+        fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) | O_NONBLOCK);
+        fcntl(f->fd, F_SETFD, FD_CLOEXEC);
+    }
+    if (f->fd != -1) {
+        if (f->wd != -1)
+            inotify_rm_watch(f->fd, f->wd);
+        f->wd = inotify_add_watch(f->fd, E.filename,
+                IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    }
+#endif
+    f->moved = 0;
+    f->ready = 1;   /* it may have grown since it was loaded */
+    return 0;
+}
+
+int
+editor_follow_start()
+{
+    struct follow_state * f = &E.follow;
+
+    if (f->buf == NULL && (f->buf = malloc(FOLLOW_CHUNK)) == NULL)
+        die("malloc");
+    if (editor_follow_watch() == -1)
+        return -1;
+    f->active = 1;
+    return 0;
+}
+
+void
+editor_follow_to_end()
+{
+    if (E.cy != E.numrows - 1) {
+        E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        E.cx = 0;
+    }
+}
+
+/* Add what was read from the followed file to the end of the buffer. The
+   first line goes on the end of the last row if that never got its
+   newline. */
+void
+editor_follow_append(char * s, int len)
+{
+    char * end = s + len, * nl;
+    int n;
+
+    for (; s < end; s = nl + 1) {
+        nl = memchr(s, '\n', end - s);
+        n = (nl ? nl : end) - s;
+        if (nl != NULL)
+            while (n > 0 && s[n-1] == '\r')
+                n--;
+        if (E.follow.partial && E.numrows > 0) {
+            int y = E.numrows - 1;
+            erow * row = rows_at(y);
+            char c;
+
+            if (n > 0)
+                editor_row_append_string(y, s, n);
+            /* a \r that came just before this read */
+            while (nl != NULL && n == 0 && row->size > 0) {
+                editor_row_copy(row, row->size - 1, 1, &c);
+                if (c != '\r')
+                    break;
+                editor_row_del_string(y, row->size - 1, 1);
+            }
+        } else {
+            editor_insert_row(E.numrows, s, n);
+        }
+        E.follow.partial = nl == NULL;
+        if (nl == NULL)
+            break;
+    }
+}
+
+/* The file at E.filename is not the one being followed any more, or it
+   was truncated: load it again from the start, unless that would lose
+   edits. */
+void
+editor_follow_reload()
+{
+    char * name;
+
+    if (E.dirty) {
+        editor_follow_stop();
+        editor_set_status_message("%.40s changed under unsaved edits; "
+                "stopped following", E.filename);
+        return;
+    }
+    name = strdup(E.filename);
+    editor_open(name);
+    free(name);
+    if (editor_follow_watch() == -1) {
+        editor_follow_stop();
+        editor_set_status_message("Can't follow %.40s: %s", E.filename,
+                strerror(errno));
+        return;
+    }
+    editor_follow_to_end();
+    editor_set_status_message("Reloaded %.60s", E.filename);
+}
+
+/* Called from the main loop while following. Reads only what was added
+   to the file since it was last read, up to FOLLOW_BATCH bytes so the
+   screen keeps up; the rest is left for the next call. If the cursor was
+   on the last row it stays there. */
+void
+editor_follow_poll()
+{
+    struct follow_state * f = &E.follow;
+    struct stat st, cur;
+    int at_end = E.cy >= E.numrows - 1;
+    int dirty = E.dirty;
+    long total = 0;
+    ssize_t n;
+
+    if (!f->ready && !f->moved && f->wd != -1)
+        return;
+    f->ready = 0;
+    if (fstat(f->file, &st) == -1)
+        return;
+    if (st.st_size < f->off) {
+        editor_follow_reload();
+        return;
+    }
+
+    E.undo.off = 1;
+    while (total < FOLLOW_BATCH &&
+            (n = pread(f->file, f->buf, FOLLOW_CHUNK, f->off)) > 0) {
+        editor_follow_append(f->buf, n);
+        f->off += n;
+        total += n;
+    }
+    E.undo.off = 0;
+    E.dirty = dirty;
+    if (total >= FOLLOW_BATCH)
+        f->ready = 1;
+    if (total > 0 && at_end)
+        editor_follow_to_end();
+
+    /* once the old file is read to the end, switch to the new one */
+    if (f->moved && !f->ready) {
+        if (stat(E.filename, &cur) == -1)
+            return;     /* not there yet; look again on the next tick */
+        if (cur.st_ino != st.st_ino || cur.st_dev != st.st_dev)
+            editor_follow_reload();
+        else
+            f->moved = 0;
+    }
+}
+
+/* The same for the other buffers. Each is swapped in to be appended to,
+   through a window showing it if there is one, so that the cursor there
+   stays on the last row. */
+void
+editor_follow_poll_others()
+{
+    int focus = E.curwin, cur = E.curbuf;
+    int j, k;
+
+    for (j = 0; j < E.nbufs; j++) {
+        struct follow_state * f = &E.bufs[j].follow;
+        if (j == cur || !f->active || (!f->ready && !f->moved && f->wd != -1))
+            continue;
+        for (k = 0; k < E.nwins && (k == focus || E.wins[k].buf != j); k++)
+            ;
+        if (k < E.nwins)
+            editor_window_enter(k);
+        else
+            editor_buffer_select(j);
+        editor_follow_poll();
+        if (k < E.nwins)
+            editor_window_enter(focus);
+        else
+            editor_buffer_select(cur);
+    }
+}
+
+/* Take the snapshot a save writes out: every row becomes one span, or two
+   for a gap row, and is frozen until the save is over. This is O(rows) and
+   only copies the text of inline rows. */
+void
+editor_save_snapshot(struct save_job * job)
+{
+    long cap = E.numrows + 64;
+    struct rowiter it;
+    struct rowbuf * b;
+    erow * row;
+
+    job->seg = malloc(sizeof(struct save_seg) * cap);
+    if (job->seg == NULL)
+        die("malloc");
+    job->nseg = 0;
+    job->total = 0;
+    for (row = rows_iter_begin(&it, 0); row; row = rows_iter_next(&it)) {
+        struct save_seg * seg;
+
+        if (job->nseg + 2 > cap) {
+            cap *= 2;
+            job->seg = realloc(job->seg, sizeof(struct save_seg) * cap);
+            if (job->seg == NULL)
+                die("realloc");
+        }
+        seg = &job->seg[job->nseg];
+        b = row->flags & ROW_GAP ? editor_row_head(row) : NULL;
+        if (b && b->gap < row->size) {
+            seg->p = row->chars.p;
+            seg->len = b->gap;
+            seg->eol = 0;
+            seg++;
+            seg->p = &row->chars.p[b->gap + b->cap - row->size];
+            seg->len = row->size - b->gap;
+            job->nseg++;
+        } else if (row->flags & ROW_INLINE) {
+            seg->p = NULL;
+            memcpy(seg->in, row->chars.in, row->size);
+            seg->len = row->size;
+        } else {
+            seg->p = row->chars.p;
+            seg->len = row->size;
+        }
+        seg->eol = 1;
+        job->nseg++;
+        job->total += row->size + 1;
+        if (!(row->flags & ROW_INLINE))
+            row->flags |= ROW_FROZEN;
+    }
+}
+
+/* Stream the snapshot to fd. Row text is handed to writev() where it lies,
+   so the only memory used is one batch of iovecs and short lines. */
+int
+editor_write_snapshot(struct save_job * job, int fd)
+{
+    long written = 0;
+    int ret = 0;
+    long j;
+    struct abuf ab = ABUF_INIT
+
+    for (j=0; j<job->nseg; j++) {
+        struct save_seg * seg = &job->seg[j];
+
+        if (seg->p)
+            ab_append_ref(&ab, seg->p, seg->len);
+        else
+            ab_append(&ab, seg->in, seg->len);
+        written += seg->len;
+        if (seg->eol) {
+            ab_append(&ab, "\n", 1);
+            written++;
+        }
+
+        if (ab.nseg >= AB_IOV_MAX - 3 || ab.len >= SAVE_BATCH || j == job->nseg - 1) {
+            if ((ret = ab_write(&ab, fd)) == -1)
+                break;
+            ab_reset(&ab);
+            pthread_mutex_lock(&job->lock);
+            job->written = written;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    abFree(&ab);
+    return ret;
+}
+
+/* Follow symlinks so that a save replaces the file they point at instead
+   of the link itself. */
+char *
+editor_resolve_links(const char * filename)
+{
+    char * path = strdup(filename);
+    int depth;
+
+    for (depth = 0; depth < 40; depth++) {
+        char target[PATH_MAX];
+        struct stat st;
+        char * next, * slash;
+        ssize_t n;
+
+        if (lstat(path, &st) == -1 || !S_ISLNK(st.st_mode))
+            break;
+        n = readlink(path, target, sizeof(target) - 1);
+        if (n == -1)
+            break;
+        target[n] = '\0';
+
+        slash = strrchr(path, '/');
+        if (target[0] == '/' || slash == NULL) {
+            next = strdup(target);
+        } else {
+            int dirlen = slash - path + 1;
+            next = malloc(dirlen + n + 1);
+            memcpy(next, path, dirlen);
+            memcpy(&next[dirlen], target, n + 1);
+        }
+        free(path);
+        path = next;
+    }
+    return path;
+}
+
+/* Make a rename in path's directory survive a crash. */
+void
+editor_sync_dir(const char * path)
+{
+    char * dir = strdup(path);
+    char * slash = strrchr(dir, '/');
+    int fd;
+
+    if (slash == dir)
+        slash[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+    fd = open(slash ? dir : ".", O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+/* Write the snapshot to a temporary file next to the target and rename it
+   over the target, so that a crash leaves either the old file or the new
+   one. Returns -1 with errno set on failure. */
+int
+editor_save_file(struct save_job * job)
+{
+    char * tmp = malloc(strlen(job->path) + sizeof(".pedXXXXXX"));
+    struct stat st;
+    int fd, ok, err;
+
+    if (tmp == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    sprintf(tmp, "%s.pedXXXXXX", job->path);
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        return -1;
+    }
+
+    if (stat(job->path, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+        if (fchown(fd, st.st_uid, st.st_gid) == -1) {
+            /* only root can give the file away; keep our own uid */
+        }
+    } else {
+        fchmod(fd, job->mode);
+    }
+
+    ok = editor_write_snapshot(job, fd) == 0 && fsync(fd) == 0;
+    err = errno;
+    if (close(fd) == -1 && ok) {
+        ok = 0;
+        err = errno;
+    }
+    if (ok && rename(tmp, job->path) == 0) {
+        editor_sync_dir(job->path);
+        free(tmp);
+        return 0;
+    }
+    if (ok)
+        err = errno;
+    unlink(tmp);
+    free(tmp);
+    errno = err;
+    return -1;
+}
+
+void *
+editor_save_worker(void * arg)
+{
+    struct save_job * job = arg;
+    int ret = editor_save_file(job);
+    int err = errno;
+
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    job->err = ret == -1 ? err : 0;
+    clock_gettime(CLOCK_MONOTONIC, &job->end);
+    pthread_mutex_unlock(&job->lock);
+    write(E.sigpipe[1], "s", 1);
+    return NULL;
+}
+
+/* Called from the main loop while a save is active. Reports progress, or
+   once the worker is finished (or wait is set) joins it and cleans up. The
+   saved buffer need not be the current one any more. */
+void
+editor_save_poll(int wait)
+{
+    struct save_job * job = &E.save;
+    int cur = E.curbuf;
+    double secs;
+    int j;
+
+    pthread_mutex_lock(&job->lock);
+    if (!job->done && !wait) {
+        editor_set_status_message("Saving... %d%% (%ld of %ld bytes)",
+                (int) (job->total ? job->written * 100 / job->total : 0),
+                job->written, job->total);
+        pthread_mutex_unlock(&job->lock);
+        return;
+    }
+    pthread_mutex_unlock(&job->lock);
+    pthread_join(job->thread, NULL);
+
+    editor_buffer_select(job->buf);
+    job->active = 0;
+    for (j=0; j<job->ngarbage; j++)
+        arena_free(&E.arena, job->garbage[j].p, job->garbage[j].n);
+    job->ngarbage = 0;
+    free(job->seg);
+    job->seg = NULL;
+    free(job->path);
+    job->path = NULL;
+
+    if (job->err) {
+        editor_set_status_message("Can't save! I/O error: %s", strerror(job->err));
+    } else {
+        secs = (job->end.tv_sec - job->start.tv_sec) +
+            (job->end.tv_nsec - job->start.tv_nsec) / 1e9;
+        editor_set_status_message("%ld bytes written to disk in %.2fs (%.1f MB/s)",
+                job->written, secs, secs > 0 ? job->written / secs / 1e6 : 0.0);
+        /* whatever was edited while the save ran is still unsaved */
+        E.dirty -= job->dirty;
+        if (E.dirty < 0)
+            E.dirty = 0;
+        E.follow.off = job->written;
+        E.follow.partial = 0;
+    }
+    editor_buffer_select(cur);
+}
+
+/* Start writing the file out on a worker thread. The rows are snapshotted
+   first, so editing can go on while the save runs. */
+void
+editor_save()
+{
+    struct save_job * job = &E.save;
+    struct stat st;
+
+    if (job->active) {
+        editor_set_status_message("A save is already running");
+        return;
+    }
+    if (E.filename == NULL) {
+        E.filename = editor_prompt("Save as: %s", NULL);
+        if (E.filename == NULL) {
+            editor_set_status_message("Save aborted");
+            return;
+        }
+        editor_select_syntax();
+        editor_invalidate_frame();
+    }
+
+    /* the save replaces the file, so there is nothing left to follow */
+    if (E.follow.active)
+        editor_follow_stop();
+    job->path = editor_resolve_links(E.filename);
+    if (stat(job->path, &st) == -1) {
+        mode_t mask = umask(0);
+        umask(mask);
+        job->mode = 0666 & ~mask;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    editor_save_snapshot(job);
+    job->buf = E.curbuf;
+    job->dirty = E.dirty;
+    job->written = 0;
+    job->done = 0;
+    job->err = 0;
+    if ((errno = pthread_create(&job->thread, NULL, editor_save_worker, job)) != 0) {
+        editor_set_status_message("Can't save! %s", strerror(errno));
+        free(job->seg);
+        job->seg = NULL;
+        free(job->path);
+        job->path = NULL;
+        return;
+    }
+    job->active = 1;
+    editor_set_status_message("Saving...");
+}
+
+/*** regex ***/
+
+/* Regular expressions for the search prompt: literals, ., [classes], the
+   escapes \d \w \s \D \W \S, ( ), |, * + ? and the anchors ^ and $. A
+   pattern compiles to a Thompson NFA, which is run as a DFA built lazily
+   one state at a time, so matching is linear in the length of the text
+   however the pattern is written.
+
+   Matches are leftmost-longest and do not overlap. A row is first scanned
+   backwards with the DFA of the reversed pattern, a new thread joining at
+   every position: wherever it accepts, a match starts. Then, going
+   forwards, the DFA of the pattern itself finds where each match that is
+   taken ends, and the next one is looked for from there. */
+
+enum re_op { RE_OP_CAT = -5, RE_OP_ALT, RE_OP_STAR, RE_OP_PLUS, RE_OP_QUEST };
+
+int
+re_set_has(const unsigned char * set, int c)
+{
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+void
+re_set_add(unsigned char * set, int lo, int hi)
+{
+    for (; lo <= hi; lo++)
+        set[lo >> 3] |= 1 << (lo & 7);
+}
+
+/* Add the class of the escape \c to set. Returns 0 if c does not name a
+   class, in which case the escape stands for c itself. */
+int
+re_escape_class(unsigned char * set, int c)
+{
+    unsigned char cls[RE_SETLEN];
+    int j;
+
+    memset(cls, 0, sizeof(cls));
+    switch (tolower(c)) {
+        case 'd':
+            re_set_add(cls, '0', '9');
+            break;
+        case 'w':
+            re_set_add(cls, '0', '9');
+            re_set_add(cls, 'a', 'z');
+            re_set_add(cls, 'A', 'Z');
+            re_set_add(cls, '_', '_');
+            break;
+        case 's':
+            re_set_add(cls, '\t', '\r');
+            re_set_add(cls, ' ', ' ');
+            break;
+        default:
+            return 0;
+    }
+    for (j = 0; j < RE_BOL; j++)
+        if ((re_set_has(cls, j) != 0) != (isupper(c) != 0))
+            re_set_add(set, j, j);
+    return 1;
+}
+
+/* The byte an escaped character inside or outside a class stands for. */
+int
+re_escape_char(int c)
+{
+    return c == 't' ? '\t' : c;
+}
+
+/* Parse the atom at *pp into set and advance past it. Returns -1 on a
+   syntax error. */
+int
+re_parse_atom(const char ** pp, unsigned char * set)
+{
+    const char * p = *pp;
+    int c = (unsigned char) *p++;
+    int lo, hi, j;
+
+    memset(set, 0, RE_SETLEN);
+    if (c == '.') {
+        re_set_add(set, 0, RE_BOL - 1);
+    } else if (c == '^') {
+        re_set_add(set, RE_BOL, RE_BOL);
+    } else if (c == '$') {
+        re_set_add(set, RE_EOL, RE_EOL);
+    } else if (c == '\\') {
+        if (*p == '\0')
+            return -1;
+        c = (unsigned char) *p++;
+        if (!re_escape_class(set, c))
+            re_set_add(set, re_escape_char(c), re_escape_char(c));
+    } else if (c == '[') {
+        int neg = *p == '^';
+        if (neg)
+            p++;
+        /* a ] right after the [ is taken literally */
+        do {
+            lo = (unsigned char) *p++;
+            if (lo == '\0')
+                return -1;
+            if (lo == '\\') {
+                if (*p == '\0')
+                    return -1;
+                lo = (unsigned char) *p++;
+                if (re_escape_class(set, lo))
+                    continue;
+                lo = re_escape_char(lo);
+            }
+            hi = lo;
+            if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+                hi = (unsigned char) p[1];
+                p += 2;
+                if (hi == '\\') {
+                    if (*p == '\0')
+                        return -1;
+                    hi = re_escape_char((unsigned char) *p++);
+                }
+                if (hi < lo)
+                    return -1;
+            }
+            re_set_add(set, lo, hi);
+        } while (*p != ']');
+        p++;
+        if (neg)
+            for (j = 0; j < RE_BOL / 8; j++)
+                set[j] = ~set[j];
+    } else {
+        re_set_add(set, c, c);
+    }
+    *pp = p;
+    return 0;
+}
+
+/* Convert pattern to postfix with explicit concatenation, the order
+   Thompson's construction wants. Atoms are parsed into sets and appear in
+   post as their index; operators are the negative re_op values. Returns
+   the length of post, or -1 on a syntax error. */
+int
+re_postfix(const char * p, int * post, unsigned char (* sets)[RE_SETLEN])
+{
+    struct { int nalt, natom; } * paren = malloc(sizeof(*paren) * (strlen(p) + 1));
+    int nalt = 0, natom = 0;
+    int depth = 0;
+    int n = 0, nsets = 0;
+
+    if (paren == NULL)
+        die("malloc");
+    while (*p) {
+        switch (*p) {
+            case '(':
+                if (natom > 1) {
+                    natom--;
+                    post[n++] = RE_OP_CAT;
+                }
+                paren[depth].nalt = nalt;
+                paren[depth].natom = natom;
+                depth++;
+                nalt = natom = 0;
+                p++;
+                break;
+            case '|':
+                if (natom == 0)
+                    goto error;
+                while (--natom > 0)
+                    post[n++] = RE_OP_CAT;
+                nalt++;
+                p++;
+                break;
+            case ')':
+                if (depth == 0 || natom == 0)
+                    goto error;
+                while (--natom > 0)
+                    post[n++] = RE_OP_CAT;
+                for (; nalt > 0; nalt--)
+                    post[n++] = RE_OP_ALT;
+                depth--;
+                nalt = paren[depth].nalt;
+                natom = paren[depth].natom + 1;
+                p++;
+                break;
+            case '*':
+            case '+':
+            case '?':
+                if (natom == 0)
+                    goto error;
+                post[n++] = *p == '*' ? RE_OP_STAR : *p == '+' ? RE_OP_PLUS : RE_OP_QUEST;
+                p++;
+                break;
+            default:
+                if (natom > 1) {
+                    natom--;
+                    post[n++] = RE_OP_CAT;
+                }
+                if (re_parse_atom(&p, sets[nsets]) == -1)
+                    goto error;
+                post[n++] = nsets++;
+                natom++;
+                break;
+        }
+    }
+    if (depth != 0 || natom == 0)
+        goto error;
+    while (--natom > 0)
+        post[n++] = RE_OP_CAT;
+    for (; nalt > 0; nalt--)
+        post[n++] = RE_OP_ALT;
+    free(paren);
+    return n;
+
+error:
+    free(paren);
+    return -1;
+}
+
+int
+re_state_new(struct re_prog * prog, int kind, int out, int out1)
+{
+    struct re_state * s;
+
+    if (prog->nst == prog->cap) {
+        prog->cap = prog->cap ? prog->cap * 2 : 64;
+        prog->st = realloc(prog->st, sizeof(struct re_state) * prog->cap);
+        if (prog->st == NULL)
+            die("realloc");
+    }
+    s = &prog->st[prog->nst];
+    s->kind = kind;
+    s->out = out;
+    s->out1 = out1;
+    memset(s->set, 0, RE_SETLEN);
+    return prog->nst++;
+}
+
+/* Thompson's construction from the postfix expression, for the pattern
+   or, if reverse is set, for the pattern reversed. Each fragment has one
+   way in, start, and one way out, end: an epsilon state patched once the
+   next fragment is known. */
+void
+re_build(struct re_prog * prog, const int * post, int n,
+        unsigned char (* sets)[RE_SETLEN], int reverse)
+{
+    struct { int start, end; } * frag = malloc(sizeof(*frag) * n), a, b;
+    int sp = 0;
+    int j, s, e;
+
+    if (frag == NULL)
+        die("malloc");
+    for (j = 0; j < n; j++) {
+        int op = post[j];
+        if (op >= 0) {
+            e = re_state_new(prog, RE_EPS, -1, -1);
+            s = re_state_new(prog, RE_SET, e, -1);
+            memcpy(prog->st[s].set, sets[op], RE_SETLEN);
+        } else if (op == RE_OP_CAT) {
+            a = frag[sp - (reverse ? 1 : 2)];
+            b = frag[sp - (reverse ? 2 : 1)];
+            sp -= 2;
+            prog->st[a.end].out = b.start;
+            s = a.start;
+            e = b.end;
+        } else if (op == RE_OP_ALT) {
+            sp -= 2;
+            e = re_state_new(prog, RE_EPS, -1, -1);
+            s = re_state_new(prog, RE_SPLIT, frag[sp].start, frag[sp + 1].start);
+            prog->st[frag[sp].end].out = e;
+            prog->st[frag[sp + 1].end].out = e;
+        } else {
+            sp--;
+            e = re_state_new(prog, RE_EPS, -1, -1);
+            s = re_state_new(prog, RE_SPLIT, frag[sp].start, e);
+            prog->st[frag[sp].end].out = op == RE_OP_QUEST ? e : s;
+            if (op == RE_OP_PLUS)
+                s = frag[sp].start;
+        }
+        frag[sp].start = s;
+        frag[sp].end = e;
+        sp++;
+    }
+    prog->st[frag[0].end].out = re_state_new(prog, RE_MATCH, -1, -1);
+    prog->start = frag[0].start;
+    free(frag);
+}
+
+/* The literal every match of the postfix expression must start with. */
+void
+re_prefix(struct regex * re, const int * post, int n, unsigned char (* sets)[RE_SETLEN])
+{
+    struct { char s[RE_PREFIX_MAX]; int len; int exact; } * stk, * a, * b;
+    int sp = 0;
+    int j, c, m;
+
+    if ((stk = malloc(sizeof(*stk) * n)) == NULL)
+        die("malloc");
+    for (j = 0; j < n; j++) {
+        switch (post[j]) {
+            case RE_OP_CAT:
+                a = &stk[sp - 2];
+                b = &stk[--sp];
+                if (a->exact) {
+                    m = a->len + b->len > RE_PREFIX_MAX ? RE_PREFIX_MAX - a->len : b->len;
+                    memcpy(&a->s[a->len], b->s, m);
+                    a->len += m;
+                    a->exact = b->exact && m == b->len;
+                }
+                break;
+            case RE_OP_PLUS:
+                stk[sp - 1].exact = 0;
+                break;
+            case RE_OP_ALT:
+                sp--;
+                stk[sp - 1].len = 0;
+                stk[sp - 1].exact = 0;
+                break;
+            case RE_OP_STAR:
+            case RE_OP_QUEST:
+                stk[sp - 1].len = 0;
+                stk[sp - 1].exact = 0;
+                break;
+            default:
+                /* an atom that is a single byte, or an anchor */
+                a = &stk[sp++];
+                a->len = 0;
+                a->exact = 0;
+                for (c = 0, m = 0; c < RE_SYMS; c++)
+                    if (re_set_has(sets[post[j]], c))
+                        m++;
+                for (c = 0; m == 1 && !re_set_has(sets[post[j]], c); c++)
+                    ;
+                if (m == 1 && c >= RE_BOL)
+                    a->exact = 1;
+                else if (m == 1) {
+                    a->s[a->len++] = c;
+                    a->exact = 1;
+                }
+                break;
+        }
+    }
+    memcpy(re->prefix, stk[0].s, stk[0].len);
+    re->prefixlen = stk[0].len;
+    free(stk);
+}
+
+void
+regex_free(struct regex * re)
+{
+    if (re == NULL)
+        return;
+    free(re->fwd.st);
+    free(re->rev.st);
+    free(re);
+}
+
+/* Compile pattern, or return NULL if it is not a valid expression. */
+struct regex *
+regex_compile(const char * pattern)
+{
+    int len = strlen(pattern);
+    int * post = malloc(sizeof(int) * (2 * len + 1));
+    unsigned char (* sets)[RE_SETLEN] = malloc(RE_SETLEN * (len + 1));
+    struct regex * re = NULL;
+    int n;
+
+    if (post == NULL || sets == NULL)
+        die("malloc");
+    if ((n = re_postfix(pattern, post, sets)) != -1) {
+        if ((re = calloc(1, sizeof(struct regex))) == NULL)
+            die("calloc");
+        re_build(&re->fwd, post, n, sets, 0);
+        re_build(&re->rev, post, n, sets, 1);
+        re_prefix(re, post, n, sets);
+    }
+    free(post);
+    free(sets);
+    return re;
+}
+
+void
+dfa_init(struct dfa * d, struct re_prog * prog, int anchored)
+{
+    int j;
+
+    memset(d, 0, sizeof(*d));
+    d->prog = prog;
+    d->anchored = anchored;
+    d->start = -1;
+    d->nbucket = 1024;
+    d->bucket = malloc(sizeof(int) * d->nbucket);
+    d->list = malloc(sizeof(int) * prog->nst);
+    d->stack = malloc(sizeof(int) * prog->nst);
+    d->mark = calloc(prog->nst, sizeof(int));
+    if (d->bucket == NULL || d->list == NULL || d->stack == NULL || d->mark == NULL)
+        die("malloc");
+    for (j = 0; j < d->nbucket; j++)
+        d->bucket[j] = -1;
+}
+
+/* Drop every state. Indexes held by the caller are no longer valid. */
+void
+dfa_flush(struct dfa * d)
+{
+    int j;
+
+    for (j = 0; j < d->nst; j++)
+        free(d->st[j].nfa);
+    for (j = 0; j < d->nbucket; j++)
+        d->bucket[j] = -1;
+    d->nst = 0;
+    d->mem = 0;
+    d->start = -1;
+    d->nflush++;
+}
+
+void
+dfa_free(struct dfa * d)
+{
+    if (d->prog == NULL)
+        return;
+    dfa_flush(d);
+    free(d->st);
+    free(d->bucket);
+    free(d->list);
+    free(d->stack);
+    free(d->mark);
+    memset(d, 0, sizeof(*d));
+}
+
+/* Append the states reachable from s without reading a symbol to
+   d->list, keeping only the ones a DFA state is made of. States already
+   marked in this generation are skipped. */
+void
+dfa_closure(struct dfa * d, int s, int * n)
+{
+    struct re_state * st = d->prog->st;
+    int sp = 0;
+
+    if (d->mark[s] == d->gen)
+        return;
+    d->mark[s] = d->gen;
+    d->stack[sp++] = s;
+    while (sp > 0) {
+        s = d->stack[--sp];
+        if (st[s].kind == RE_SET || st[s].kind == RE_MATCH) {
+            d->list[(*n)++] = s;
+            continue;
+        }
+        if (st[s].kind == RE_SPLIT && d->mark[st[s].out1] != d->gen) {
+            d->mark[st[s].out1] = d->gen;
+            d->stack[sp++] = st[s].out1;
+        }
+        if (d->mark[st[s].out] != d->gen) {
+            d->mark[st[s].out] = d->gen;
+            d->stack[sp++] = st[s].out;
+        }
+    }
+}
+
+/* Start a new set of marks for dfa_closure. */
+void
+dfa_new_gen(struct dfa * d)
+{
+    if (++d->gen == INT_MAX) {
+        memset(d->mark, 0, sizeof(int) * d->prog->nst);
+        d->gen = 1;
+    }
+}
+
+int
+dfa_cmp_int(const void * a, const void * b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+/* The state for the sorted NFA states list[0..n), added if it is new. */
+int
+dfa_add(struct dfa * d, const int * list, int n)
+{
+    unsigned long h = n;
+    struct dfa_state * ds;
+    int j, s;
+
+    for (j = 0; j < n; j++)
+        h = h * 31 + list[j];
+    h %= d->nbucket;
+    for (s = d->bucket[h]; s != -1; s = d->st[s].chain)
+        if (d->st[s].n == n && memcmp(d->st[s].nfa, list, sizeof(int) * n) == 0)
+            return s;
+
+    if (d->nst == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->st = realloc(d->st, sizeof(struct dfa_state) * d->cap);
+        if (d->st == NULL)
+            die("realloc");
+    }
+    s = d->nst++;
+    ds = &d->st[s];
+    if ((ds->nfa = malloc(sizeof(int) * (n ? n : 1))) == NULL)
+        die("malloc");
+    memcpy(ds->nfa, list, sizeof(int) * n);
+    ds->n = n;
+    ds->accept = 0;
+    for (j = 0; j < n; j++)
+        if (d->prog->st[list[j]].kind == RE_MATCH)
+            ds->accept = 1;
+    for (j = 0; j < RE_SYMS; j++)
+        ds->next[j] = -1;
+    ds->chain = d->bucket[h];
+    d->bucket[h] = s;
+    d->mem += sizeof(struct dfa_state) + sizeof(int) * n;
+    return s;
+}
+
+int
+dfa_start(struct dfa * d)
+{
+    int n = 0;
+
+    if (d->start == -1) {
+        dfa_new_gen(d);
+        dfa_closure(d, d->prog->start, &n);
+        qsort(d->list, n, sizeof(int), dfa_cmp_int);
+        d->start = dfa_add(d, d->list, n);
+    }
+    return d->start;
+}
+
+/* The state after reading symbol c in state s. Unless the DFA is
+   anchored a new thread joins after every byte. The row boundaries are
+   zero width: threads that do not step on them stay where they are, and
+   the ones that do may step on the same boundary again. */
+int
+dfa_next(struct dfa * d, int s, int c)
+{
+    struct re_state * nfa = d->prog->st;
+    int n = 0;
+    int j, q, t;
+
+    if (d->st[s].next[c] != -1)
+        return d->st[s].next[c];
+
+    dfa_new_gen(d);
+    if (c < RE_BOL) {
+        for (j = 0; j < d->st[s].n; j++) {
+            q = d->st[s].nfa[j];
+            if (nfa[q].kind == RE_SET && re_set_has(nfa[q].set, c))
+                dfa_closure(d, nfa[q].out, &n);
+        }
+        if (!d->anchored)
+            dfa_closure(d, d->prog->start, &n);
+    } else {
+        for (j = 0; j < d->st[s].n; j++) {
+            q = d->st[s].nfa[j];
+            d->mark[q] = d->gen;
+            d->list[n++] = q;
+        }
+        for (j = 0; j < n; j++) {
+            q = d->list[j];
+            if (nfa[q].kind == RE_SET && re_set_has(nfa[q].set, c))
+                dfa_closure(d, nfa[q].out, &n);
+        }
+    }
+    qsort(d->list, n, sizeof(int), dfa_cmp_int);
+
+    if (d->mem > DFA_MEM_MAX) {
+        /* s goes away with the cache, so the transition is not kept */
+        dfa_flush(d);
+        return dfa_add(d, d->list, n);
+    }
+    t = dfa_add(d, d->list, n);
+    d->st[s].next[c] = t;
+    return t;
+}
+
+/* Scan the row s backwards with the unanchored DFA of the reversed
+   pattern, setting starts[p] for every position p where a match starts. */
+void
+dfa_starts(struct dfa * d, const char * s, int len, unsigned char * starts)
+{
+    int st = dfa_next(d, dfa_start(d), RE_EOL);
+    int p;
+
+    for (p = len; p >= 0; p--) {
+        if (p < len) {
+            int c = (unsigned char) s[p];
+            int t = d->st[st].next[c];
+            st = t != -1 ? t : dfa_next(d, st, c);
+        }
+        starts[p] = d->st[st].accept;
+        if (p == 0 && !starts[p])
+            starts[p] = d->st[dfa_next(d, st, RE_BOL)].accept;
+    }
+}
+
+/* The end of the longest match starting at p, run with the anchored DFA
+   of the pattern, or -1 if there is none. */
+int
+dfa_longest(struct dfa * d, const char * s, int len, int p)
+{
+    int st = dfa_start(d);
+    int end = -1;
+    int t;
+
+    if (p == 0)
+        st = dfa_next(d, st, RE_BOL);
+    for (; d->st[st].n > 0; p++) {
+        if (d->st[st].accept)
+            end = p;
+        if (p == len) {
+            if (d->st[dfa_next(d, st, RE_EOL)].accept)
+                end = p;
+            break;
+        }
+        t = d->st[st].next[(unsigned char) s[p]];
+        st = t != -1 ? t : dfa_next(d, st, (unsigned char) s[p]);
+    }
+    return end;
+}
+
+/*** find ***/
+
+/* Index of the first occurrence of needle in hay, or -1. With SSE2, 16
+   candidate positions are tested at once by comparing both the first and
+   the last byte of the needle; only positions where both agree are
+   checked with memcmp. That discards almost every position in one vector
+   compare, even for needles whose first byte is common. */
+int
+find_substr(const char * hay, int len, const char * needle, int m)
+{
+    const char * p, * end;
+
+    if (m == 0)
+        return 0;
+    if (m > len)
+        return -1;
+    if (m == 1) {
+        p = memchr(hay, needle[0], len);
+        return p ? p - hay : -1;
+    }
+    p = hay;
+    end = hay + len - m + 1;    /* one past the last possible start */
+
+#ifdef __SSE2__
+    {
+        __m128i first = _mm_set1_epi8(needle[0]);
+        __m128i last = _mm_set1_epi8(needle[m - 1]);
+
+        for (; end - p >= 16; p += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *) p);
+            __m128i b = _mm_loadu_si128((const __m128i *) (p + m - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+                        _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+            while (mask) {
+                int bit = 0;
+                while (!(mask & (1u << bit)))
+                    bit++;
+                if (memcmp(p + bit + 1, needle + 1, m - 2) == 0)
+                    return p + bit - hay;
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+
+    while (p < end) {
+        p = memchr(p, needle[0], end - p);
+        if (p == NULL)
+            return -1;
+        if (p[m - 1] == needle[m - 1] && memcmp(p + 1, needle + 1, m - 2) == 0)
+            return p - hay;
+        p++;
+    }
+    return -1;
+}
+
+/* Index of the last occurrence of needle that starts before limit, or -1. */
+int
+find_substr_last(const char * hay, int len, const char * needle, int m, int limit)
+{
+    int found = -1;
+    int at = 0;
+    int j;
+
+    while (at < limit && (j = find_substr(&hay[at], len - at, needle, m)) != -1) {
+        if (at + j >= limit)
+            break;
+        found = at + j;
+        at = found + 1;
+    }
+    return found;
+}
+
+void
+matcher_init(struct matcher * m, struct regex * re)
+{
+    m->re = re;
+    if (re) {
+        dfa_init(&m->rev, &re->rev, 0);
+        dfa_init(&m->fwd, &re->fwd, 1);
+    }
+}
+
+void
+matcher_free(struct matcher * m)
+{
+    dfa_free(&m->rev);
+    dfa_free(&m->fwd);
+    free(m->starts);
+    m->starts = NULL;
+    m->startscap = 0;
+    m->re = NULL;
+}
+
+/* The matches of m's regex in the row s: returns how many start before
+   limit, and sets *first to the first one at or after x and *last to the
+   last one before limit, or -1. */
+int
+matcher_row(struct matcher * m, const char * s, int len, int x, int limit,
+        int * first, int * last)
+{
+    int n = 0;
+    int p, end;
+
+    *first = -1;
+    *last = -1;
+    if (find_substr(s, len, m->re->prefix, m->re->prefixlen) == -1)
+        return 0;
+    if (len + 1 > m->startscap) {
+        m->startscap = len + 1 > 2 * m->startscap ? len + 1 : 2 * m->startscap;
+        free(m->starts);
+        if ((m->starts = malloc(m->startscap)) == NULL)
+            die("malloc");
+    }
+    dfa_starts(&m->rev, s, len, m->starts);
+    for (p = 0; p <= len; p++) {
+        if (!m->starts[p])
+            continue;
+        if (p >= limit && *first != -1)
+            break;
+        if (p < limit) {
+            n++;
+            *last = p;
+        }
+        if (p >= x && *first == -1)
+            *first = p;
+        /* the next match can start where this one ends */
+        if ((end = dfa_longest(&m->fwd, s, len, p)) > p)
+            p = end - 1;
+    }
+    return n;
+}
+
+/* The functions below look for the query in one row: as a literal if
+   m->re is NULL, else as a regex run with m's DFAs. */
+
+/* Matches in s that start before limit. */
+int
+find_row_count(struct matcher * m, const char * s, int len, int limit)
+{
+    struct find_state * f = &E.find;
+    int n = 0;
+    int x = 0;
+    int j;
+
+    if (m->re)
+        return matcher_row(m, s, len, len + 1, limit, &x, &j);
+    while ((j = find_substr(&s[x], len - x, f->query, f->qlen)) != -1 &&
+            x + j < limit) {
+        n++;
+        x += j + 1;
+    }
+    return n;
+}
+
+/* The first match in s at or after x, or -1. */
+int
+find_row_next(struct matcher * m, const char * s, int len, int x)
+{
+    struct find_state * f = &E.find;
+    int first, last;
+    int j;
+
+    if (x > len)
+        return -1;
+    if (m->re) {
+        matcher_row(m, s, len, x, 0, &first, &last);
+        return first;
+    }
+    return (j = find_substr(&s[x], len - x, f->query, f->qlen)) == -1 ? -1 : x + j;
+}
+
+/* The last match in s that starts before x, or -1. */
+int
+find_row_prev(struct matcher * m, const char * s, int len, int x)
+{
+    struct find_state * f = &E.find;
+    int first, last;
+
+    if (m->re) {
+        matcher_row(m, s, len, x, x, &first, &last);
+        return last;
+    }
+    return find_substr_last(s, len, f->query, f->qlen, x);
+}
+
+/* Matches of the query in rows [first, last). Reads the snapshot rather
+   than the rows, so it is safe on any thread while the search prompt is
+   open. */
+int
+editor_find_count(struct matcher * m, int first, int last)
+{
+    struct find_span * span = E.find.span;
+    int n = 0;
+    int y;
+
+    for (y = first; y < last; y++)
+        n += find_row_count(m, span[y].p, span[y].len, span[y].len + 1);
+    return n;
+}
+
+/* Count chunk i and record the result. Called with f->lock held, which is
+   dropped while the rows are scanned. */
+void
+editor_find_run_chunk(struct find_state * f, int i, struct matcher * m)
+{
+    int first = i * FIND_CHUNK;
+    int last = first + FIND_CHUNK < f->numrows ? first + FIND_CHUNK : f->numrows;
+    int n;
+
+    f->count[i] = FIND_RUNNING;
+    f->running++;
+    pthread_mutex_unlock(&f->lock);
+    n = editor_find_count(m, first, last);
+    pthread_mutex_lock(&f->lock);
+    f->running--;
+    f->count[i] = n;
+    f->ndone++;
+    f->total += n;
+    pthread_cond_broadcast(&f->done);
+    /* redraw as soon as the screen's own rows are in, and at the end */
+    if (i == f->order[0] || f->ndone == f->nchunks)
+        write(E.sigpipe[1], "f", 1);
+}
+
+void *
+editor_find_worker(void * arg)
+{
+    struct find_state * f = &E.find;
+
+    pthread_mutex_lock(&f->lock);
+    while (1) {
+        int i;
+        while (f->next == f->nchunks)
+            pthread_cond_wait(&f->work, &f->lock);
+        i = f->order[f->next++];
+        if (f->count[i] == FIND_TODO)
+            editor_find_run_chunk(f, i, arg);
+    }
+    return NULL;
+}
+
+/* Stop handing out chunks and wait for the ones being counted. */
+void
+editor_find_cancel()
+{
+    struct find_state * f = &E.find;
+
+    pthread_mutex_lock(&f->lock);
+    f->next = f->nchunks;
+    while (f->running > 0)
+        pthread_cond_wait(&f->done, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* Start counting the matches of query over the whole file. */
+void
+editor_find_start(const char * query)
+{
+    struct find_state * f = &E.find;
+    int start, j, todo;
+
+    editor_find_cancel();
+    pthread_mutex_lock(&f->lock);
+    free(f->query);
+    f->query = strdup(query);
+    f->qlen = strlen(query);
+    f->total = 0;
+    for (j = 0; j <= FIND_THREADS_MAX; j++)
+        matcher_free(&f->match[j]);
+    regex_free(f->re);
+    f->re = f->regex && f->qlen ? regex_compile(query) : NULL;
+    f->bad = f->regex && f->qlen && f->re == NULL;
+    for (j = 0; j <= FIND_THREADS_MAX; j++)
+        matcher_init(&f->match[j], f->re);
+    todo = f->qlen && !f->bad;
+    start = f->nchunks ? (E.rowoff / FIND_CHUNK) % f->nchunks : 0;
+    for (j = 0; j < f->nchunks; j++) {
+        f->count[j] = FIND_TODO;
+        f->order[j] = (start + j) % f->nchunks;
+    }
+    f->next = todo ? 0 : f->nchunks;
+    f->ndone = todo ? 0 : f->nchunks;
+    pthread_cond_broadcast(&f->work);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* Wait until chunk i is counted, counting it here if no worker has taken
+   it yet. Returns its count. */
+int
+editor_find_wait_chunk(int i)
+{
+    struct find_state * f = &E.find;
+    int n;
+
+    pthread_mutex_lock(&f->lock);
+    if (f->count[i] == FIND_TODO)
+        editor_find_run_chunk(f, i, &f->match[FIND_THREADS_MAX]);
+    while (f->count[i] == FIND_RUNNING)
+        pthread_cond_wait(&f->done, &f->lock);
+    n = f->count[i];
+    pthread_mutex_unlock(&f->lock);
+    return n;
+}
+
+/* Find the first match at or after column x of row y, or the last one
+   before it if dir is -1, within the rows of y's chunk. Returns the row of
+   the match and sets *mx, or returns -1. */
+int
+editor_find_in_chunk(int y, int x, int dir, int * mx)
+{
+    int first = y / FIND_CHUNK * FIND_CHUNK;
+    int last = first + FIND_CHUNK < E.numrows ? first + FIND_CHUNK : E.numrows;
+    struct matcher * m = &E.find.match[FIND_THREADS_MAX];
+    struct rowiter it;
+    erow * row = rows_iter_begin(&it, y);
+
+    while (row) {
+        int j;
+        if (dir > 0) {
+            j = find_row_next(m, editor_row_buf(row), row->size, x);
+            if (j != -1) {
+                *mx = j;
+                return y;
+            }
+            if (++y == last)
+                break;
+            row = rows_iter_next(&it);
+            x = 0;
+        } else {
+            j = find_row_prev(m, editor_row_buf(row), row->size, x);
+            if (j != -1) {
+                *mx = j;
+                return y;
+            }
+            if (y-- == first)
+                break;
+            row = rows_iter_prev(&it);
+            x = row->size + 1;
+        }
+    }
+    return -1;
+}
+
+/* Look for the next match from column x of row y, or the previous one if
+   dir is -1, wrapping around the ends of the file. Chunks the index says
+   are empty are skipped without being read. */
+int
+editor_find_step(int y, int x, int dir, int * mx)
+{
+    struct find_state * f = &E.find;
+    int c = y / FIND_CHUNK;
+    int n;
+
+    if (f->nchunks == 0)
+        return -1;
+    if ((y = editor_find_in_chunk(y, x, dir, mx)) != -1)
+        return y;
+    for (n = 0; n < f->nchunks; n++) {
+        c = (c + dir + f->nchunks) % f->nchunks;
+        if (editor_find_wait_chunk(c) == 0)
+            continue;
+        if (dir > 0)
+            y = editor_find_in_chunk(c * FIND_CHUNK, 0, 1, mx);
+        else {
+            y = c * FIND_CHUNK + FIND_CHUNK - 1;
+            if (y >= E.numrows)
+                y = E.numrows - 1;
+            y = editor_find_in_chunk(y, rows_at(y)->size + 1, -1, mx);
+        }
+        if (y != -1)
+            return y;
+    }
+    return -1;
+}
+
+/* Matches in the chunk of (y, x) that come before it. */
+int
+editor_find_rank(int y, int x)
+{
+    struct matcher * m = &E.find.match[FIND_THREADS_MAX];
+    int first = y / FIND_CHUNK * FIND_CHUNK;
+    erow * row = rows_at(y);
+
+    return editor_find_count(m, first, y) + find_row_count(m, editor_row_buf(row), row->size, x);
+}
+
+void
+editor_find_set_prompt()
+{
+    snprintf(E.find.prompt, sizeof(E.find.prompt), "%s: %%s (ESC/Arrows/Enter, "
+            "Ctrl-R = %s)", E.find.regex ? "Regex" : "Search",
+            E.find.regex ? "literal" : "regex");
+}
+
+/* Called by editor_prompt after every key. Typing starts a new count and
+   searches again from where the cursor was when the search started; the
+   arrow keys move to the next or previous match and Ctrl-R switches
+   between literal and regex search. */
+void
+editor_find_callback(char * query, int key)
+{
+    struct find_state * f = &E.find;
+    int dir = 1;
+    int y, x, mx;
+
+    if (key == CTRL_KEY('r')) {
+        f->regex = !f->regex;
+        editor_find_set_prompt();
+    }
+    if (key == '\r' || key == ESC_CHAR) {
+        if (key == ESC_CHAR) {
+            E.cx = f->cx;
+            E.cy = f->cy;
+            E.coloff = f->coloff;
+            E.rowoff = f->rowoff;
+        }
+        return;
+    }
+
+    if (f->y != -1 && (key == KEY_RIGHT || key == KEY_DOWN)) {
+        y = f->y;
+        x = f->x + 1;
+    } else if (f->y != -1 && (key == KEY_LEFT || key == KEY_UP)) {
+        y = f->y;
+        x = f->x;
+        dir = -1;
+    } else if (key == CTRL_KEY('r') || f->query == NULL || strcmp(query, f->query) != 0) {
+        editor_find_start(query);
+        y = f->cy < E.numrows ? f->cy : 0;
+        x = f->cy < E.numrows ? f->cx : 0;
+    } else {
+        return;
     }
-    editor_row_insert_char(&E.row[E.cy], E.cx, c);
-    E.cx++;
+
+    if (query[0] == '\0' || f->bad || (y = editor_find_step(y, x, dir, &mx)) == -1) {
+        f->y = -1;
+        E.cx = f->cx;
+        E.cy = f->cy;
+        return;
+    }
+    f->rank = editor_find_rank(y, mx);
+    f->y = y;
+    f->x = mx;
+    E.cy = y;
+    E.cx = mx;
+    /* bring a match that is off screen to the top */
+    if (y < E.rowoff || y >= E.rowoff + E.screenrows)
+        E.rowoff = E.numrows;
 }
 
+/* Start the worker pool the first time it is needed. */
 void
-editor_insert_new_line()
+editor_find_init()
 {
-    if (E.cx == 0) {
-        editor_insert_row(E.cy, "", 0);
-    } else {
-        erow * row = &E.row[E.cy];
-        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy]; /* needed because editor_insert_row calls realloc! */
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
-    }
-    E.cy++;
-    E.cx = 0;
+    struct find_state * f = &E.find;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (f->nthreads > 0)
+        return;
+    if (n > FIND_THREADS_MAX)
+        n = FIND_THREADS_MAX;
+    while (f->nthreads < n && pthread_create(&f->thread[f->nthreads], NULL,
+                editor_find_worker, &f->match[f->nthreads]) == 0)
+        f->nthreads++;
 }
 
+/* Record where each row's chars are for the workers, which must not
+   read the rows themselves: drawing a row while the prompt is open, in
+   this window or another one on the same buffer, rewrites its flags and
+   render block. The chars stay put, as no row is edited until the prompt
+   closes. Rows split by a gap are joined first, since the matchers read
+   chars directly. Only called while the workers are idle. */
 void
-editor_del_char()
+editor_find_snapshot()
 {
+    struct find_state * f = &E.find;
+    struct rowiter it;
     erow * row;
-    if (E.cy == E.numrows)
-        return;
-    if (E.cx == 0 && E.cy == 0)
-        return;
-    row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editor_row_del_char(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        editor_row_append_string(&E.row[E.cy - 1], row->chars, row->size);
-        editor_del_row(E.cy);
-        E.cy--;
+    int y = 0;
+
+    if (E.numrows > f->spancap) {
+        struct find_span * span = realloc(f->span, sizeof(*span) * E.numrows);
+
+        if (span == NULL)
+            die("realloc");
+        f->span = span;
+        f->spancap = E.numrows;
+    }
+    for (row = rows_iter_begin(&it, 0); row; row = rows_iter_next(&it), y++) {
+        if (row->flags & ROW_GAP)
+            editor_row_chars(row);
+        f->span[y].p = editor_row_buf(row);
+        f->span[y].len = row->size;
     }
+    f->numrows = E.numrows;
 }
 
 void
-editor_scroll()
+editor_find()
 {
-    E.rx = E.cx;
-    if (E.cy < E.numrows) {
-        E.rx = editor_row_cx_to_rx(&E.row[E.cy], E.cx);
-    }
+    struct find_state * f = &E.find;
+    char * query;
+    int * p;
 
-    if (E.cy < E.rowoff) {
-        E.rowoff = E.cy;
-    }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
-    }
-    if (E.rx < E.coloff) {
-        E.coloff = E.rx;
-    }
-    if (E.rx >= E.coloff + E.screencols) {
-        E.coloff = E.rx - E.screencols + 1;
-    }
+    editor_find_init();
+
+    pthread_mutex_lock(&f->lock);
+    editor_find_snapshot();
+    f->nchunks = (E.numrows + FIND_CHUNK - 1) / FIND_CHUNK;
+    if ((p = realloc(f->count, sizeof(int) * (f->nchunks + 1))) == NULL)
+        die("realloc");
+    f->count = p;
+    if ((p = realloc(f->order, sizeof(int) * (f->nchunks + 1))) == NULL)
+        die("realloc");
+    f->order = p;
+    f->next = f->nchunks;
+    f->ndone = f->nchunks;
+    free(f->query);
+    f->query = NULL;
+    pthread_mutex_unlock(&f->lock);
+
+    f->cx = E.cx;
+    f->cy = E.cy;
+    f->coloff = E.coloff;
+    f->rowoff = E.rowoff;
+    f->y = -1;
+    f->active = 1;
+
+    editor_find_set_prompt();
+    query = editor_prompt(f->prompt, editor_find_callback);
+    editor_find_cancel();
+    f->active = 0;
+    free(query);
 }
 
+/*** commands ***/
+
+/* Show filename in the focused window: switch to the buffer it is open in,
+   or load it into a new one. The empty buffer ped starts with is used
+   rather than kept. */
 void
-editor_draw_rows(struct abuf * ab)
+editor_buffer_open(char * filename)
 {
-    int y;
-    for (y = 0; y < E.screenrows; y++) {
-        int filerow = y  + E.rowoff;
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows / 3) {
-                int padding;
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome), "ped editor -- version %s", "1.0");
-                if (welcomelen > E.screencols)
-                    welcomelen = E.screencols;
-                padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    ab_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    ab_append(ab, " ", 1);
-                ab_append(ab, welcome, welcomelen);
-            } else {
-                ab_append(ab, "~", 1);
-            }
-        } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0)
-                len = 0;
-            if (len > E.screencols)
-                len = E.screencols;
-            ab_append(ab, &E.row[filerow].render[E.coloff], len);
+    int j;
+
+    for (j = 0; j < E.nbufs; j++) {
+        char * name = editor_buffer_name(j);
+        if (name && strcmp(name, filename) == 0) {
+            editor_buffer_select(j);
+            return;
         }
-        ab_append(ab, CLR_ROW, CLR_ROW_LEN);
-        ab_append(ab, "\r\n", 2);
     }
+    if (E.filename || E.numrows > 0 || E.dirty)
+        editor_buffer_new();
+    editor_open(filename);
 }
 
+/* Free the current buffer and switch to a neighbour, which windows that
+   showed it go on to show as well. The last buffer is only emptied. */
 void
-editor_draw_status_bar(struct abuf * ab)
+editor_buffer_close()
 {
-    char status[80];
-    char rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-            E.filename ? E.filename : "[No Name]", E.numrows,
-            E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-            E.cy + 1, E.numrows);
-
-    if (len > E.screencols)
-        len = E.screencols;
+    int cur = E.curbuf, next;
+    int j;
 
-    ab_append(ab, status, len);
+    if (E.save.active && E.save.buf == cur)
+        editor_save_poll(1);
+    if (E.follow.active)
+        editor_follow_stop();
+    if (E.follow.fd != -1)
+        close(E.follow.fd);
+    free(E.follow.buf);
+    editor_close();
+    free(E.undo.buf);
+    if (E.nbufs == 1) {
+        E.nbufs = 0;
+        editor_buffer_new();
+        return;
+    }
 
-    ab_append(ab, INV_COLOR, INV_COLOR_LEN);
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            ab_append(ab, rstatus, rlen);
-            break;
-        } else {
-            ab_append(ab, " ", 1);
-            len++;
+    next = cur + 1 < E.nbufs ? cur + 1 : cur - 1;
+    editor_buffer_load(&E.bufs[next]);
+    editor_clamp_cursor();
+    memmove(&E.bufs[cur], &E.bufs[cur + 1], sizeof(struct buffer) * (E.nbufs - cur - 1));
+    E.nbufs--;
+    E.curbuf = next > cur ? next - 1 : next;
+    for (j = 0; j < E.nwins; j++) {
+        struct window * w = &E.wins[j];
+        if (j == E.curwin)
+            continue;
+        if (w->buf == cur) {
+            w->buf = E.curbuf;
+            w->cx = E.cx;
+            w->cy = E.cy;
+            w->rowoff = E.rowoff;
+            w->coloff = E.coloff;
+        } else if (w->buf > cur) {
+            w->buf--;
         }
     }
-    ab_append(ab, NORMAL_COLOR, NORMAL_COLOR_LEN);
-    ab_append(ab, "\r\n", 2);
+    if (E.save.active && E.save.buf > cur)
+        E.save.buf--;
 }
 
+/* Commands typed at the Ctrl-X prompt. */
+
 void
-editor_draw_message_bar(struct abuf * ab)
+editor_cmd_stats(char * args)
 {
-    int msglen = strlen(E.statusmsg);
-    ab_append(ab, CLR_ROW, CLR_ROW_LEN);
-    if (msglen > E.screencols)
-        msglen = E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
-        ab_append(ab, E.statusmsg, msglen);
+    (void) args;
+    editor_set_status_message("arena: %lu allocs %lu frees %lu mallocs "
+            "%lu slabs %luK live %lu big",
+            E.arena.nalloc, E.arena.nfree, E.arena.nsys, E.arena.nslabs,
+            (unsigned long) (E.arena.live / 1024), E.arena.nbig);
 }
 
+/* Memory per row, as the arena rounds it: the tree with its erows, chars
+   buffers of rows that own one and render blocks. Mapped and inline rows
+   take no chars buffer, and nor do plain rows drawn without highlighting
+   a render block. */
 void
-editor_refresh_screen()
+editor_cmd_rowmem(char * args)
 {
-    char buf[32];
-    struct abuf ab = ABUF_INIT;
+    struct rowiter it;
+    erow * row;
+    double n = E.numrows ? E.numrows : 1;
+    double tree = rows_mem(E.rows), text = 0, render = 0;
+    long ninline = 0, nmapped = 0;
 
-    editor_scroll();
+    (void) args;
+    for (row = rows_iter_begin(&it, 0); row; row = rows_iter_next(&it)) {
+        if (row->flags & ROW_INLINE)
+            ninline++;
+        else if (row->flags & ROW_MAPPED)
+            nmapped++;
+        else
+            text += arena_round(sizeof(struct rowbuf) + editor_row_cap(row));
+        if (row->render)
+            render += arena_round(editor_render_bytes(row));
+    }
+    editor_set_status_message("%.1f B/row: %.1f tree %.1f chars %.1f render "
+            "| %ld inline %ld mapped", (tree + text + render) / n, tree / n,
+            text / n, render / n, ninline, nmapped);
+}
+
+void
+editor_cmd_compact(char * args)
+{
+    unsigned long before = E.arena.nslabs;
 
-    ab_append(&ab, HIDE_CUR, HIDE_CUR_LEN);
-    ab_append(&ab, CUR_TOP_LEFT, CUR_TOP_LEFT_LEN);
+    (void) args;
+    if (E.save.active) {
+        editor_set_status_message("Can't compact while saving");
+        return;
+    }
+    editor_compact();
+    editor_set_status_message("Compacted: %lu slabs -> %lu slabs",
+            before, E.arena.nslabs);
+}
 
-    editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
-    editor_draw_message_bar(&ab);
+void
+editor_cmd_open(char * args)
+{
+    if (*args == '\0') {
+        editor_set_status_message("Usage: open FILE");
+        return;
+    }
+    editor_buffer_open(args);
+    editor_set_status_message("Opened %.60s", args);
+}
 
-    snprintf(buf, sizeof(buf), ESC "[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    ab_append(&ab, buf, strlen(buf));
+/* List the buffers, the current one in brackets and modified ones with a
+   +, by number and the last part of their name. */
+void
+editor_cmd_buffers(char * args)
+{
+    char list[sizeof(E.statusmsg)];
+    int len = 0;
+    int j;
 
-    ab_append(&ab, SHOW_CUR, SHOW_CUR_LEN);
+    (void) args;
+    for (j = 0; j < E.nbufs && len < (int) sizeof(list); j++) {
+        char * name = editor_buffer_name(j);
+        char * slash = name ? strrchr(name, '/') : NULL;
+        int dirty = j == E.curbuf ? E.dirty : E.bufs[j].dirty;
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+        len += snprintf(&list[len], sizeof(list) - len,
+                j == E.curbuf ? "[%d %s%s] " : "%d %s%s ", j + 1,
+                slash ? slash + 1 : name ? name : "[No Name]", dirty ? "+" : "");
+    }
+    editor_set_status_message("%s", list);
 }
 
 void
-editor_set_status_message(const char * fmt, ...)
+editor_cmd_buffer(char * args)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-    va_end(ap);
-    E.statusmsg_time = time(NULL);
+    char * end;
+    long n = strtol(args, &end, 10);
+
+    if (end == args || *end != '\0' || n < 1 || n > E.nbufs) {
+        editor_set_status_message("Usage: buffer N, from 1 to %d", E.nbufs);
+        return;
+    }
+    editor_buffer_select(n - 1);
 }
 
-char *
-editor_prompt(char * prompt)
+void
+editor_cmd_bclose(char * args)
 {
-    size_t bufsize = 128;
-    char * buf = malloc(bufsize);
-
-    size_t buflen = 0;
-    buf[0] = '\0';
+    (void) args;
+    if (E.dirty) {
+        editor_set_status_message("File has unsaved changes");
+        return;
+    }
+    editor_buffer_close();
+}
 
-    while (1) {
-        int c;
+/* Split the focused window in two, with FILE in the new half if given. */
+void
+editor_cmd_split(char * args)
+{
+    if (E.termrows - 1 - (E.nwins + 1) < E.nwins + 1) {
+        editor_set_status_message("No room for another window");
+        return;
+    }
+    editor_window_add();
+    editor_layout();
+    if (*args != '\0')
+        editor_buffer_open(args);
+}
 
-        editor_set_status_message(prompt, buf);
-        editor_refresh_screen();
+/* Close the focused window, giving its lines to the others. */
+void
+editor_cmd_close(char * args)
+{
+    int j = E.curwin;
 
-        c = editor_read_key();
-        if (c == KEY_DEL || c == CTRL_KEY('h') || c == KEY_BACKSPACE) {
-            if (buflen != 0)
-                buf[--buflen] = '\0';
-        } else if (c == ESC_CHAR) {
-            editor_set_status_message("");
-            free(buf);
-            return NULL;
-        } else if (c == '\r') {
-            if (buflen != 0) {
-                editor_set_status_message("");
-                return buf;
-            }
-        } else if (!iscntrl(c) && c < 128) {
-            if (buflen == bufsize -1) {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
-            }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
-        }
+    (void) args;
+    if (E.nwins == 1) {
+        editor_set_status_message("Can't close the only window");
+        return;
     }
+    editor_window_load(j > 0 ? j - 1 : j + 1);
+    editor_window_remove(j);
+    editor_layout();
 }
 
+/* Close every window but the focused one. */
 void
-editor_move_cursor(int key)
+editor_cmd_only(char * args)
 {
-    int rowlen;
-    erow * row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    (void) args;
+    editor_window_store();
+    E.wins[0] = E.wins[E.curwin];
+    E.nwins = 1;
+    E.curwin = 0;
+    editor_layout();
+}
 
-    switch (key) {
-        case KEY_LEFT:
-            if (E.cx > 0) {
-                E.cx--;
-            } else if (E.cy > 0) {
-                E.cy--;
-                E.cx = E.row[E.cy].size;
-            }
-            break;
-        case KEY_RIGHT:
-            if (row && E.cx < row->size) {
-                E.cx++;
-            } else if (row && E.cx == row->size) {
-                E.cy++;
-                E.cx = 0;
-            }
-            break;
-        case KEY_UP:
-            if (E.cy > 0)
-                E.cy--;
-            break;
-        case KEY_DOWN:
-            if (E.cy < E.numrows - 1)
-                E.cy++;
-            break;
+void
+editor_cmd_follow(char * args)
+{
+    (void) args;
+    if (E.follow.active) {
+        editor_follow_stop();
+        editor_set_status_message("Stopped following");
+        return;
+    }
+    if (E.filename == NULL || E.save.active) {
+        editor_set_status_message("Nothing to follow until the file is saved");
+        return;
+    }
+    if (editor_follow_start() == -1) {
+        editor_set_status_message("Can't follow %.40s: %s", E.filename,
+                strerror(errno));
+        return;
     }
+    editor_follow_to_end();
+    editor_set_status_message("Following %.60s", E.filename);
+}
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    rowlen = row ? row->size : 0;
-    if (E.cx > rowlen)
-        E.cx = rowlen;
+/* Toggle the profiler. With a file name, profiling starts and the
+   histogram is written there on exit. */
+void
+editor_cmd_profile(char * args)
+{
+    if (E.prof.on && *args == '\0') {
+        E.prof.on = 0;
+        editor_set_status_message("Profiling off");
+        return;
+    }
+    prof_enable(*args ? args : NULL);
+    editor_set_status_message("Profiling: p50/p99 us of wait key scroll draw "
+            "output%s%.30s", *args ? ", dump to " : "", args);
 }
 
-#if 0
-/* TODO: debug */
-ssize_t
-my_getline(char ** s, size_t * cap, FILE * stream)
+/* Count the matches of a pattern over the whole file as a literal and as
+   a regex on this thread, to compare the two matchers. */
+void
+editor_cmd_findbench(char * args)
 {
-    char buf[100];
-    size_t len = 0;
-    buf[99] = '\0';
-    *cap = sizeof(buf);
-    *s = malloc(*cap);
-    (*s)[0] = '\0';
-    while (1) {
-        if (fgets(buf, sizeof(buf), stream) == NULL)
-            break;
-        strncpy(*s + len, buf, sizeof(buf));
-        len = strlen(buf);
-        if (len < sizeof(buf)-1)
-            break;
-        *cap *= 2;
-        *s = realloc(*s, *cap);
-        if (*s == NULL) {
-            perror("getline");
-            exit(EXIT_FAILURE);
-        }
+    struct find_state * f = &E.find;
+    struct matcher * m = &f->match[FIND_THREADS_MAX];
+    struct regex * re = regex_compile(args);
+    struct timespec t0, t1, t2;
+    struct rowiter it;
+    erow * row;
+    double bytes = 0, lit, rex;
+    int nlit, nre;
 
+    if (*args == '\0' || re == NULL) {
+        editor_set_status_message(*args ? "Bad regex" : "Usage: findbench PATTERN");
+        regex_free(re);
+        return;
     }
-    return len;
+    /* the workers are idle while the prompt is closed */
+    editor_find_snapshot();
+    for (row = rows_iter_begin(&it, 0); row; row = rows_iter_next(&it))
+        bytes += row->size;
+
+    f->query = strdup(args);
+    f->qlen = strlen(args);
+    matcher_free(m);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    nlit = editor_find_count(m, 0, E.numrows);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    matcher_init(m, re);
+    nre = editor_find_count(m, 0, E.numrows);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    lit = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    rex = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+    editor_set_status_message("literal %d in %.0f MB/s | regex %d in %.0f MB/s, "
+            "%d states", nlit, lit > 0 ? bytes / lit / 1e6 : 0.0, nre,
+            rex > 0 ? bytes / rex / 1e6 : 0.0, m->rev.nst + m->fwd.nst);
+    matcher_free(m);
+    regex_free(re);
+    free(f->query);
+    f->query = NULL;
 }
-#endif
 
-char *
-editor_rows_to_string(int * buflen)
+/* Put the cursor at the start of row y, scrolling it to the middle of the
+   screen if it is off it. */
+void
+editor_goto(int y)
 {
-    int totlen = 0;
-    int j;
-    char * buf, * p;
+    if (y > E.numrows - 1)
+        y = E.numrows - 1;
+    if (y < 0)
+        y = 0;
+    E.cy = y;
+    E.cx = 0;
+    if (y < E.rowoff || y >= E.rowoff + E.screenrows) {
+        E.rowoff = y - E.screenrows / 2;
+        if (E.rowoff < 0)
+            E.rowoff = 0;
+    }
+}
 
-    for (j=0; j<E.numrows; j++)
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
+/* Go to a line number, a percentage of the way through the file or, after
+   an @, a byte offset. */
+void
+editor_cmd_goto(char * args)
+{
+    char * num = args + (*args == '@');
+    char * end;
+    long n = strtol(num, &end, 10);
 
-    buf = malloc(totlen);
-    p = buf;
+    if (end == num || (*end != '\0' && !(*end == '%' && end[1] == '\0' && num == args))) {
+        editor_set_status_message("Usage: goto LINE | goto N%% | goto @BYTE");
+        return;
+    }
+    if (num != args)
+        editor_goto(rows_at_offset(n));
+    else if (*end == '%')
+        editor_goto(rows_at_offset(E.rows ? (long) (E.rows->bytes * (n / 100.0)) : 0));
+    else
+        editor_goto(n - 1);
+    editor_set_status_message("Line %d of %d, byte %ld", E.cy + 1, E.numrows,
+            rows_offset(E.cy));
+}
 
-    for (j=0; j<E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+/* A size in bytes or with a K or M suffix, or -1 if args is not one. */
+long
+editor_parse_size(char * args)
+{
+    char * end;
+    long n = strtol(args, &end, 10);
+
+    if (*end == 'K' || *end == 'k') {
+        n <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        n <<= 20;
+        end++;
     }
+    if (end == args || *end != '\0' || n < 0)
+        return -1;
+    return n;
+}
+
+/* Set the memory cap of the undo history of the current buffer, which new
+   buffers inherit. The history is cleared. */
+void
+editor_cmd_undomem(char * args)
+{
+    long n = editor_parse_size(args);
 
-    return buf;
+    if (n < (long) sizeof(struct undo_rec)) {
+        editor_set_status_message("Undo memory: %luK (usage: undomem SIZE[K|M])",
+                (E.undo.cap ? E.undo.cap : UNDO_MEM) >> 10);
+        return;
+    }
+    free(E.undo.buf);
+    E.undo.buf = NULL;
+    E.undo.cap = n;
+    undo_clear();
+    editor_set_status_message("Undo memory set to %ldK", n >> 10);
 }
 
+/* Show what the render cache holds, or set its cap. Anything over a lower
+   cap is freed once the next frame is drawn. */
 void
-editor_open(char * filename)
+editor_cmd_rendermem(char * args)
 {
-    char * line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    FILE * fp = fopen(filename, "r");
-    free(E.filename);
-    E.filename = strdup(filename);
-    if (fp == NULL)
-        return;
+    struct render_cache * c = &E.rcache;
+    long n = editor_parse_size(args);
 
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 &&
-                (line[linelen-1] == '\n' ||
-                 line[linelen-1] == '\r'))
-            linelen--;
-        editor_insert_row(E.numrows, line, linelen);
+    if (*args != '\0' && n < 0) {
+        editor_set_status_message("Usage: rendermem [SIZE[K|M]]");
+        return;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    if (*args != '\0')
+        c->cap = n;
+    editor_set_status_message("Render cache: %luK of %luK in %d buffers, "
+            "%lu leaves freed", (unsigned long) (c->bytes >> 10),
+            (unsigned long) (c->cap >> 10), E.nbufs, c->ntrim);
 }
 
+struct editor_command {
+    const char * name;
+    void (* fn)(char * args);
+};
+
+struct editor_command editor_commands[] = {
+    { "stats",      editor_cmd_stats },
+    { "compact",    editor_cmd_compact },
+    { "rowmem",     editor_cmd_rowmem },
+    { "open",       editor_cmd_open },
+    { "findbench",  editor_cmd_findbench },
+    { "goto",       editor_cmd_goto },
+    { "undomem",    editor_cmd_undomem },
+    { "follow",     editor_cmd_follow },
+    { "profile",    editor_cmd_profile },
+    { "buffers",    editor_cmd_buffers },
+    { "buffer",     editor_cmd_buffer },
+    { "bclose",     editor_cmd_bclose },
+    { "split",      editor_cmd_split },
+    { "close",      editor_cmd_close },
+    { "only",       editor_cmd_only },
+    { "rendermem",  editor_cmd_rendermem },
+    { NULL,         NULL }
+};
+
 void
-editor_save()
+editor_command()
 {
-    int len;
-    char * buf;
-    int fd;
-    if (E.filename == NULL) {
-        E.filename = editor_prompt("Save as: %s");
-        if (E.filename == NULL) {
-            editor_set_status_message("Save aborted");
-            return;
-        }
-    }
+    struct editor_command * cmd;
+    char * line = editor_prompt("Command: %s", NULL);
+    char * args;
+    size_t len;
 
-    buf = editor_rows_to_string(&len);
-    fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                editor_set_status_message("%d bytes written to disk", len);
-                E.dirty = 0;
-                return;
-            }
+    if (line == NULL)
+        return;
+    len = strcspn(line, " ");
+    args = line + len;
+    while (*args == ' ')
+        args++;
+
+    for (cmd = editor_commands; cmd->name; cmd++) {
+        if (strlen(cmd->name) == len && strncmp(cmd->name, line, len) == 0) {
+            cmd->fn(args);
+            break;
         }
-        close(fd);
     }
-    free(buf);
-    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+    if (cmd->name == NULL)
+        editor_set_status_message("Unknown command: %.40s", line);
+    free(line);
 }
 
 void
@@ -769,16 +6714,44 @@ editor_process_keypress()
 {
     static int quit_times = QUIT_TIMES;
     int c = editor_read_key();
+    double t0, inner;
+
+    if (c == KEY_REDRAW)
+        return;
+    if (E.prof.on)
+        prof_add(PROF_WAIT, E.prof.waited);
+    E.prof.waited = 0;
+    t0 = prof_start();
+    inner = E.prof.inner;
+
+    E.undo.seq++;
+    E.undo.cx = E.cx;
+    E.undo.cy = E.cy;
 
     switch (c) {
         case '\r':
             editor_insert_new_line();
             break;
 
+        case CTRL_KEY('z'):
+            editor_undo();
+            break;
+
+        case CTRL_KEY('y'):
+            editor_redo();
+            break;
+
         case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
-                editor_set_status_message("WARNING: File has unsaved changes. "
-                        "Press Ctrl-Q %d more times to quit.", quit_times);
+            if (E.save.active)
+                editor_save_poll(1);
+            if (editor_buffers_dirty() > 0 && quit_times > 0) {
+                if (E.dirty && editor_buffers_dirty() == 1)
+                    editor_set_status_message("WARNING: File has unsaved changes. "
+                            "Press Ctrl-Q %d more times to quit.", quit_times);
+                else
+                    editor_set_status_message("WARNING: %d of %d files unsaved. "
+                            "Press Ctrl-Q %d more times to quit.",
+                            editor_buffers_dirty(), E.nbufs, quit_times);
                 quit_times--;
                 return;
             }
@@ -791,20 +6764,49 @@ editor_process_keypress()
             editor_save();
             break;
 
+        case CTRL_KEY('x'):
+            editor_command();
+            break;
+
+        case CTRL_KEY('f'):
+            editor_find();
+            break;
+
+        case CTRL_KEY('n'):
+            editor_buffer_select((E.curbuf + 1) % E.nbufs);
+            break;
+
+        case CTRL_KEY('p'):
+            editor_buffer_select((E.curbuf + E.nbufs - 1) % E.nbufs);
+            break;
+
+        case CTRL_KEY('w'):
+            editor_window_enter((E.curwin + 1) % E.nwins);
+            break;
+
         case KEY_PG_UP:
+            E.cy = E.rowoff - E.screenrows;
+            if (E.cy < 0)
+                E.cy = 0;
+            editor_move_cursor(0);
+            break;
+
         case KEY_PG_DN:
+            E.cy = E.rowoff + E.screenrows - 1;
+            if (E.cy >= E.numrows)
+                E.cy = E.numrows;
+            else if ((E.cy += E.screenrows) > E.numrows - 1)
+                E.cy = E.numrows - 1;
+            editor_move_cursor(0);
+            break;
+
+        case CTRL_KEY('g'):
             {
-                int times;
-                if (c == KEY_PG_UP) {
-                    E.cy = E.rowoff;
-                } else if (c == KEY_PG_DN) {
-                    E.cy = E.rowoff + E.screenrows - 1;
-                    if (E.cy > E.numrows)
-                        E.cy = E.numrows;
+                char * line = editor_prompt("Go to (line, N%% or @byte): %s", NULL);
+                if (line) {
+                    editor_cmd_goto(line);
+                    free(line);
                 }
-                times = E.screenrows;
-                while (times--)
-                    editor_move_cursor(c == KEY_PG_UP ? KEY_UP : KEY_DOWN);
             }
             break;
 
@@ -813,7 +6815,8 @@ editor_process_keypress()
             break;
 
         case KEY_END:
-            E.cx = E.row[E.cy].size;
+            if (E.cy < E.numrows)
+                E.cx = rows_at(E.cy)->size;
             break;
 
         case KEY_BACKSPACE:
@@ -832,15 +6835,37 @@ editor_process_keypress()
             break;
 
         case CTRL_KEY('l'):
+            editor_invalidate_frame();
+            break;
+
         case ESC_CHAR:
             break;
 
+        case KEY_PASTE:
+            editor_insert_text(E.paste, E.pastelen);
+            break;
+
         default:
+            if (c < KEY_LEFT && (c & 0xC0) == 0xC0) {
+                char buf[4];
+                int n = editor_read_utf8(c, buf);
+                if (n > 1) {
+                    editor_insert_text(buf, n);
+                    break;
+                }
+            }
             editor_insert_char(c);
             break;
     }
 
+    if (E.undo.nundo > 0 && E.undo.nredo == 0 && undo_at(E.undo.top)->seq == E.undo.seq) {
+        undo_at(E.undo.top)->acx = E.cx;
+        undo_at(E.undo.top)->acy = E.cy;
+    }
     quit_times = QUIT_TIMES;
+    /* prompts wait and redraw inside a key; that time is not the key's */
+    if (t0 > 0 && E.prof.on)
+        prof_add(PROF_KEY, prof_now() - t0 - (E.prof.inner - inner));
 }
 
 void
@@ -852,28 +6877,682 @@ init_editor()
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = NULL;
+    E.rowcache = NULL;
+    E.rowcache_start = 0;
     E.dirty = 0;
     E.filename = NULL;
+    E.frame = NULL;
+    E.framelines = 0;
+    E.frame_rowoff = 0;
+    E.map = NULL;
+    E.maplen = 0;
+    memset(&E.arena, 0, sizeof(E.arena));
+    memset(&E.out, 0, sizeof(E.out));
+    memset(&E.line, 0, sizeof(E.line));
+    E.inpos = 0;
+    E.inlen = 0;
+    E.record = -1;
+    E.paste = NULL;
+    E.pastelen = 0;
+    E.pastecap = 0;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
-    if (get_window_size(&E.screenrows, &E.screencols) == -1)
-        die("get_window_size");
-    E.screenrows -= 2;
+    E.resized = 0;
+    E.lostmap = NULL;
+    E.zerofd = -1;
+    memset(&E.save, 0, sizeof(E.save));
+    pthread_mutex_init(&E.save.lock, NULL);
+    E.syntax = NULL;
+    E.hlrows = 0;
+    E.hlbuf = NULL;
+    E.hltext = NULL;
+    E.hlcap = 0;
+    E.marks = NULL;
+    E.markcap = 0;
+    memset(&E.prof, 0, sizeof(E.prof));
+    memset(&E.follow, 0, sizeof(E.follow));
+    E.follow.fd = E.follow.wd = E.follow.file = -1;
+    memset(&E.find, 0, sizeof(E.find));
+    pthread_mutex_init(&E.find.lock, NULL);
+    pthread_cond_init(&E.find.work, NULL);
+    pthread_cond_init(&E.find.done, NULL);
+    E.fds = NULL;
+    E.fdcap = 0;
+    memset(&E.rcache, 0, sizeof(E.rcache));
+    E.rcache.cap = RENDER_MEM;
+    E.rcache.frame = 1;
+    E.bufs = NULL;
+    E.nbufs = E.bufcap = 0;
+    editor_buffer_new();
+    E.wins = NULL;
+    E.nwins = E.wincap = 0;
+    editor_window_add();
+    editor_init_signals();
+}
+
+/*** batch ***/
+
+/* ped -b SCRIPT FILE... applies the commands in SCRIPT to each file and
+   writes back the ones that changed, without a terminal or any drawing.
+   One command per line; blank lines and lines starting with # are
+   skipped. Line numbers start at 1 and $ is the last line. Each command
+   sees the file as the ones before it left it.
+
+       delete A[,B]        delete lines A to B
+       insert N TEXT       insert TEXT as a new line before line N
+       append TEXT         add TEXT as a new last line
+       replace /OLD/NEW/   replace every OLD with NEW; any delimiter works */
+
+enum batch_op { BATCH_DELETE, BATCH_INSERT, BATCH_APPEND, BATCH_REPLACE };
+
+#define BATCH_LAST -1       /* $ */
+
+struct batch_cmd {
+    int op;
+    long a, b;
+    char * s1;              /* inserted text, or the text replaced */
+    int n1;
+    char * s2;              /* replacement */
+    int n2;
+};
+
+struct batch {
+    struct batch_cmd * cmd;
+    int ncmd;
+    char * buf;             /* scratch for building a replaced row */
+    int bufcap;
+};
+
+struct batch batch;
+
+/* Parse a line number at *p, moving *p past it. Returns 0 if there
+   isn't one. */
+int
+batch_line(char ** p, long * n)
+{
+    char * end;
+
+    if (**p == '$') {
+        (*p)++;
+        *n = BATCH_LAST;
+        return 1;
+    }
+    *n = strtol(*p, &end, 10);
+    if (end == *p || *n < 1)
+        return 0;
+    *p = end;
+    return 1;
+}
+
+/* Parse one script line into cmd. Returns -1 if it isn't a command. */
+int
+batch_parse(char * line, struct batch_cmd * cmd)
+{
+    size_t len = strcspn(line, " ");
+    char * args = line + len;
+    char * mid, * end;
+
+    while (*args == ' ')
+        args++;
+    memset(cmd, 0, sizeof(*cmd));
+    if (len == 6 && strncmp(line, "delete", len) == 0) {
+        cmd->op = BATCH_DELETE;
+        if (!batch_line(&args, &cmd->a))
+            return -1;
+        cmd->b = cmd->a;
+        if (*args == ',') {
+            args++;
+            if (!batch_line(&args, &cmd->b))
+                return -1;
+        }
+        return *args == '\0' ? 0 : -1;
+    } else if (len == 6 && strncmp(line, "insert", len) == 0) {
+        cmd->op = BATCH_INSERT;
+        if (!batch_line(&args, &cmd->a) || (*args != ' ' && *args != '\0'))
+            return -1;
+        if (*args == ' ')
+            args++;
+    } else if (len == 6 && strncmp(line, "append", len) == 0) {
+        cmd->op = BATCH_APPEND;
+    } else if (len == 7 && strncmp(line, "replace", len) == 0) {
+        cmd->op = BATCH_REPLACE;
+        if (*args == '\0' || (mid = strchr(args + 1, *args)) == NULL ||
+                (end = strchr(mid + 1, *args)) == NULL ||
+                end[1] != '\0' || mid == args + 1)
+            return -1;
+        cmd->s1 = strdup(args + 1);
+        cmd->n1 = mid - args - 1;
+        cmd->s2 = cmd->s1 + (mid - args);
+        cmd->n2 = end - mid - 1;
+        return 0;
+    } else {
+        return -1;
+    }
+    cmd->s1 = strdup(args);
+    cmd->n1 = strlen(args);
+    return 0;
+}
+
+/* Read SCRIPT into batch.cmd. Errors go to stderr. */
+int
+batch_load(const char * path)
+{
+    FILE * fp = fopen(path, "r");
+    char * line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int cap = 0, lineno = 0, ret = 0;
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        lineno++;
+        while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
+            line[--linelen] = '\0';
+        if (linelen == 0 || line[0] == '#')
+            continue;
+        if (batch.ncmd == cap) {
+            struct batch_cmd * cmd;
+
+            cap = cap ? cap * 2 : 16;
+            cmd = realloc(batch.cmd, sizeof(struct batch_cmd) * cap);
+            if (cmd == NULL)
+                die("realloc");
+            batch.cmd = cmd;
+        }
+        if (batch_parse(line, &batch.cmd[batch.ncmd]) == -1) {
+            fprintf(stderr, "%s:%d: bad command: %s\n", path, lineno, line);
+            ret = -1;
+            continue;
+        }
+        batch.ncmd++;
+    }
+    free(line);
+    fclose(fp);
+    return ret;
+}
+
+long
+batch_resolve(long n)
+{
+    return n == BATCH_LAST ? E.numrows : n;
+}
+
+/* Replace every occurrence in every row. Rows without one are only
+   scanned, so a file the command does not touch stays mapped. */
+void
+batch_replace(struct batch_cmd * cmd)
+{
+    int y;
+
+    for (y = 0; y < E.numrows; y++) {
+        erow * row = rows_at(y);
+        char * s = editor_row_chars(row);
+        int at = find_substr(s, row->size, cmd->s1, cmd->n1);
+        int p = 0, len = 0;
+
+        if (at == -1)
+            continue;
+        while (at != -1) {
+            int need = len + at + cmd->n2 + (row->size - p);
+            if (need > batch.bufcap) {
+                char * buf = realloc(batch.buf, need * 2);
+
+                if (buf == NULL)
+                    die("realloc");
+                batch.buf = buf;
+                batch.bufcap = need * 2;
+            }
+            memcpy(&batch.buf[len], &s[p], at);
+            len += at;
+            memcpy(&batch.buf[len], cmd->s2, cmd->n2);
+            len += cmd->n2;
+            p += at + cmd->n1;
+            at = find_substr(&s[p], row->size - p, cmd->s1, cmd->n1);
+        }
+        memcpy(&batch.buf[len], &s[p], row->size - p);
+        len += row->size - p;
+        editor_row_del_string(y, 0, row->size);
+        editor_row_insert_string(y, 0, batch.buf, len);
+    }
+}
+
+void
+batch_run(struct batch_cmd * cmd)
+{
+    long a, b;
+
+    switch (cmd->op) {
+        case BATCH_DELETE:
+            a = batch_resolve(cmd->a);
+            b = batch_resolve(cmd->b);
+            if (b > E.numrows)
+                b = E.numrows;
+            if (a < 1)
+                a = 1;
+            for (; b >= a; b--)
+                editor_del_row(b - 1);
+            break;
+        case BATCH_INSERT:
+            a = batch_resolve(cmd->a);
+            if (a > E.numrows + 1)
+                a = E.numrows + 1;
+            if (a < 1)
+                a = 1;
+            editor_insert_row(a - 1, cmd->s1, cmd->n1);
+            break;
+        case BATCH_APPEND:
+            editor_insert_row(E.numrows, cmd->s1, cmd->n1);
+            break;
+        case BATCH_REPLACE:
+            batch_replace(cmd);
+            break;
+    }
+}
+
+/* Write the buffer over its file on this thread, the way editor_save
+   does on its worker. */
+int
+batch_save()
+{
+    struct save_job * job = &E.save;
+    int ret;
+
+    job->path = editor_resolve_links(E.filename);
+    job->mode = 0666;
+    editor_save_snapshot(job);
+    ret = editor_save_file(job);
+    free(job->seg);
+    job->seg = NULL;
+    free(job->path);
+    job->path = NULL;
+    return ret;
+}
+
+/* Returns the exit status: 0 if every file was processed, 1 if some could
+   not be, 2 if the script is bad. */
+int
+batch_main(const char * script, int nfiles, char ** files)
+{
+    struct timespec t0, t1;
+    int j, k, changed = 0, failed = 0;
+    struct stat st;
+    double secs;
+
+    if (batch_load(script) == -1)
+        return 2;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (j = 0; j < nfiles; j++) {
+        if (stat(files[j], &st) == -1) {
+            fprintf(stderr, "%s: %s\n", files[j], strerror(errno));
+            failed++;
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "%s: not a regular file\n", files[j]);
+            failed++;
+            continue;
+        }
+        editor_open(files[j]);
+        E.undo.off = 1;
+        for (k = 0; k < batch.ncmd; k++)
+            batch_run(&batch.cmd[k]);
+        if (E.dirty) {
+            if (batch_save() == -1) {
+                fprintf(stderr, "%s: %s\n", files[j], strerror(errno));
+                failed++;
+            } else {
+                changed++;
+            }
+        }
+        E.dirty = 0;
+    }
+    editor_close();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%d files, %d changed, %d failed in %.2fs\n",
+            nfiles, changed, failed, secs);
+    return failed ? 1 : 0;
+}
+
+/*** bench ***/
+
+#ifdef PED_BENCH
+
+/* Built by make bench. Key scripts are replayed with no terminal: the
+   script is stdin, frames go to /dev/null, and each key is timed from
+   being read until its frame is written. A session can be recorded for
+   replay by running ped with PED_RECORD set to a file name. */
+
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+
+struct bench_run {
+    const char * name;
+    double * lat;               /* microseconds taken by each key */
+    int nkeys;
+    int cap;
+    double bytes;               /* frame bytes written */
+    unsigned long heap;         /* bench_nmalloc when the run started */
+    unsigned long arena;        /* and E.arena.nalloc */
+    double start;
+    int reported;
+};
+
+struct bench_run bench;
+FILE * bench_out;
+
+double
+bench_pct(double p)
+{
+    return bench.lat[(int) ((bench.nkeys - 1) * p)];
+}
+
+void
+bench_report()
+{
+    if (bench.reported || bench.nkeys == 0)
+        return;
+    bench.reported = 1;
+    qsort(bench.lat, bench.nkeys, sizeof(double), prof_cmp);
+    fprintf(bench_out, "%-8s %6d %8.1f %8.1f %8.1f %9.1f %8.0f %7.2f %7.2f %8.0f\n",
+            bench.name, bench.nkeys, bench_pct(0.5), bench_pct(0.9),
+            bench_pct(0.99), bench.lat[bench.nkeys - 1],
+            bench.bytes / bench.nkeys,
+            (double) (bench_nmalloc - bench.heap) / bench.nkeys,
+            (double) (E.arena.nalloc + E.rcache.arena.nalloc - bench.arena) / bench.nkeys,
+            (prof_now() - bench.start) / 1e3);
+    fflush(bench_out);
+}
+
+/* Replay the keys in script against file (or an empty buffer), then
+   report. */
+void
+bench_replay(const char * name, const char * script, char * file)
+{
+    struct stat st;
+    int fd = open(script, O_RDONLY);
+    int j;
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+        die(script);
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+    E.inpos = E.inlen = 0;
+    if (file)
+        editor_open(file);
+    editor_refresh_screen();
+
+    bench.name = name;
+    bench.nkeys = 0;
+    bench.bytes = 0;
+    bench.heap = bench_nmalloc;
+    bench.arena = E.arena.nalloc + E.rcache.arena.nalloc;
+    bench.reported = 0;
+    bench.start = prof_now();
+    while (E.inpos < E.inlen || lseek(STDIN_FILENO, 0, SEEK_CUR) < st.st_size) {
+        double t0 = prof_now();
+
+        editor_process_keypress();
+        if (E.save.active)
+            editor_save_poll(0);
+        editor_refresh_screen();
+        if (bench.nkeys == bench.cap) {
+            bench.cap = bench.cap ? bench.cap * 2 : 1024;
+            /* (realloc) is the real one: the benchmark's own memory
+               is not counted */
+            bench.lat = (realloc)(bench.lat, sizeof(double) * bench.cap);
+        }
+        bench.lat[bench.nkeys++] = prof_now() - t0;
+        for (j = 0; j < E.out.nseg; j++)
+            bench.bytes += E.out.seg[j].len;
+    }
+    if (E.save.active)
+        editor_save_poll(1);
+    bench_report();
+    E.dirty = 0;
+    editor_close();
+}
+
+char *
+bench_path(const char * name)
+{
+    const char * dir = getenv("TMPDIR");
+    char * path = (malloc)(PATH_MAX);
+
+    snprintf(path, PATH_MAX, "%s/ped-bench-%ld-%s", dir ? dir : "/tmp",
+            (long) getpid(), name);
+    return path;
+}
+
+FILE *
+bench_create(const char * path)
+{
+    FILE * fp = fopen(path, "w");
+
+    if (fp == NULL)
+        die(path);
+    return fp;
+}
+
+void
+bench_scenario(const char * name, FILE * keys, char * kpath, FILE * text, char * tpath)
+{
+    fclose(keys);
+    fclose(text);
+    bench_replay(name, kpath, tpath);
+    unlink(kpath);
+    unlink(tpath);
+    (free)(kpath);
+    (free)(tpath);
+}
+
+/* Typing code into the middle of a C file, with some backspacing. */
+void
+bench_typing()
+{
+    char * kpath = bench_path("typing.keys"), * tpath = bench_path("typing.c");
+    FILE * keys = bench_create(kpath), * text = bench_create(tpath);
+    int j;
+
+    for (j = 0; j < 20000; j++)
+        fprintf(text, "    for (i = 0; i < n; i++) sum += a[i] * %d; /* row %d */\n", j, j);
+    fprintf(keys, "%c10000\r", CTRL_KEY('g'));
+    for (j = 0; j < 100; j++) {
+        fputs("x = y + 42; /* typed */", keys);
+        if (j % 10 == 0)
+            fputs("\x7f\x7f\x7f\x7f\x7f", keys);
+        fputc('\r', keys);
+    }
+    bench_scenario("typing", keys, kpath, text, tpath);
+}
+
+/* Bracketed pastes of 500 lines each. */
+void
+bench_paste()
+{
+    char * kpath = bench_path("paste.keys"), * tpath = bench_path("paste.txt");
+    FILE * keys = bench_create(kpath), * text = bench_create(tpath);
+    int j, k;
+
+    for (j = 0; j < 1000; j++)
+        fprintf(text, "existing line %d\n", j);
+    for (j = 0; j < 20; j++) {
+        fputs(ESC "[200~", keys);
+        for (k = 0; k < 500; k++)
+            fprintf(keys, "pasted text %d.%d with some more words on it\r", j, k);
+        fputs(PASTE_END, keys);
+        fputs(ESC "[B" ESC "[B", keys);
+    }
+    bench_scenario("paste", keys, kpath, text, tpath);
+}
+
+/* Page down and back up through a long log, then move a line at a
+   time. */
+void
+bench_paging()
+{
+    char * kpath = bench_path("paging.keys"), * tpath = bench_path("paging.log");
+    FILE * keys = bench_create(kpath), * text = bench_create(tpath);
+    int j;
+
+    for (j = 0; j < 200000; j++)
+        fprintf(text, "2026-01-01 00:%02d:%02d INFO request %d served in %dms\n",
+                j / 60 % 60, j % 60, j, j % 97);
+    for (j = 0; j < 400; j++)
+        fputs(ESC "[6~", keys);
+    for (j = 0; j < 400; j++)
+        fputs(ESC "[5~", keys);
+    for (j = 0; j < 200; j++)
+        fputs(ESC "[B", keys);
+    bench_scenario("paging", keys, kpath, text, tpath);
+}
+
+/* Jumping around and editing a file of 1.5 million lines, then undoing
+   the edits. */
+void
+bench_huge()
+{
+    char * kpath = bench_path("huge.keys"), * tpath = bench_path("huge.log");
+    FILE * keys = bench_create(kpath), * text = bench_create(tpath);
+    int j;
+
+    for (j = 0; j < 1500000; j++)
+        fprintf(text, "2026-01-01 00:00:00 WARN worker %d queue depth %d over limit\n",
+                j % 64, j);
+    fprintf(keys, "%c50%%\r", CTRL_KEY('g'));
+    for (j = 0; j < 50; j++)
+        fputs("inserted text\r", keys);
+    fprintf(keys, "%c100%%\r", CTRL_KEY('g'));
+    for (j = 0; j < 100; j++)
+        fputs(ESC "[5~", keys);
+    fprintf(keys, "%c1\r", CTRL_KEY('g'));
+    for (j = 0; j < 100; j++)
+        fputc(CTRL_KEY('z'), keys);
+    for (j = 0; j < 100; j++)
+        fputs(ESC "[B", keys);
+    bench_scenario("huge", keys, kpath, text, tpath);
+}
+
+/* Jumps through the go to prompt by line, percentage and byte offset,
+   one prompt redraw per key typed. */
+void
+bench_goto()
+{
+    char * kpath = bench_path("goto.keys"), * tpath = bench_path("goto.txt");
+    FILE * keys = bench_create(kpath), * text = bench_create(tpath);
+    int j;
+
+    for (j = 0; j < 100000; j++)
+        fprintf(text, "line %d of the goto benchmark\n", j);
+    for (j = 0; j < 100; j++) {
+        fprintf(keys, "%c%d\r", CTRL_KEY('g'), j * 997 % 100000 + 1);
+        fprintf(keys, "%c%d%%\r", CTRL_KEY('g'), j * 37 % 101);
+        fprintf(keys, "%c@%d\r", CTRL_KEY('g'), j * 28657);
+    }
+    bench_scenario("goto", keys, kpath, text, tpath);
 }
 
+/* Two windows on one file, scrolling the lower one a line and a page at
+   a time while the upper one stays put. */
+void
+bench_split()
+{
+    char * kpath = bench_path("split.keys"), * tpath = bench_path("split.c");
+    FILE * keys = bench_create(kpath), * text = bench_create(tpath);
+    int j;
+
+    for (j = 0; j < 20000; j++)
+        fprintf(text, "    total += weight[%d] * value[i + %d]; /* term %d */\n", j % 31, j, j);
+    fprintf(keys, "%csplit\r%c", CTRL_KEY('x'), CTRL_KEY('w'));
+    for (j = 0; j < 300; j++)
+        fputs(ESC "[B", keys);
+    for (j = 0; j < 100; j++)
+        fputs(ESC "[6~", keys);
+    for (j = 0; j < 300; j++)
+        fputs(ESC "[A", keys);
+    fprintf(keys, "%conly\r", CTRL_KEY('x'));
+    bench_scenario("split", keys, kpath, text, tpath);
+}
+
+/* With no arguments run the built-in scenarios, otherwise replay
+   SCRIPT against FILE. */
 int main(int argc, char * argv[])
 {
-    enable_raw();
+    int null = open("/dev/null", O_WRONLY);
+
     init_editor();
+    editor_set_window_size(BENCH_ROWS, BENCH_COLS);
+    bench_out = fdopen(dup(STDOUT_FILENO), "w");
+    if (null == -1 || bench_out == NULL)
+        die("bench");
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    fprintf(bench_out, "%-8s %6s %8s %8s %8s %9s %8s %7s %7s %8s\n", "run", "keys",
+            "p50 us", "p90 us", "p99 us", "max us", "B/frame", "heap/k",
+            "arena/k", "total ms");
     if (argc >= 2) {
-        editor_open(argv[1]);
+        atexit(bench_report);   /* the script may end by quitting */
+        bench_replay("replay", argv[1], argc >= 3 ? argv[2] : NULL);
+        return 0;
+    }
+    bench_typing();
+    bench_paste();
+    bench_paging();
+    bench_huge();
+    bench_goto();
+    bench_split();
+    return 0;
+}
+
+#else
+
+int main(int argc, char * argv[])
+{
+    char * record = getenv("PED_RECORD");
+    char * profile = getenv("PED_PROFILE");
+    int rows, cols, j;
+
+    if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+        init_editor();
+        return batch_main(argv[2], argc - 3, argv + 3);
+    }
+    enable_raw();
+    init_editor();
+    if (get_window_size(&rows, &cols) == -1)
+        die("get_window_size");
+    editor_set_window_size(rows, cols);
+    if (record && (E.record = open(record, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        die(record);
+    if (profile)
+        prof_enable(profile);
+    if (argc >= 3 && strcmp(argv[1], "-f") == 0) {
+        editor_open(argv[2]);
+        if (editor_follow_start() == 0)
+            editor_follow_to_end();
+    } else if (argc >= 2) {
+        for (j = 1; j < argc; j++)
+            editor_buffer_open(argv[j]);
+        editor_buffer_select(0);
     }
-    editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit");
+    editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-X = command");
     while (1) {
+        if (E.lostmap)
+            editor_report_lost();
+        if (E.save.active)
+            editor_save_poll(0);
+        if (E.follow.active)
+            editor_follow_poll();
+        editor_follow_poll_others();
         editor_refresh_screen();
         editor_process_keypress();
         /*echo_key();*/
     }
     return 0;
 }
+
+#endif